@@ -1,19 +1,771 @@
 // cuevas_cristal_sfml.cpp
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <SFML/Graphics.hpp>
 #include <vector>
 #include <cmath>
 #include <string>
 #include <queue>
 #include <cstdlib>
+#include <cstdint>
 #include <ctime>
 #include <unordered_map>
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cstdio>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <set>
+#include <memory>
+#include <chrono>
 
 const int WINDOW_WIDTH = 800;
 const int WINDOW_HEIGHT = 600;
 const int TRI_SIZE = 40;
 
+// Contadores de trabajo del motor. Los bucles calientes cuentan en local y
+// suman al global una vez al terminar (ContadorLocal), así que sirven desde
+// cualquier hilo sin coste apreciable.
+enum ContadorMotor : int
+{
+    CONT_NODOS,      // nodos sacados de la cola en BFS y A*
+    CONT_VECINOS,    // vecinos examinados
+    CONT_EMPUJES,    // celdas metidas en la cola de reflejos
+    CONT_INTENTOS,   // intentos del solucionador
+    CONT_REPINTADOS, // celdas cuyo estado (y color) cambió
+    CONT_RESERVAS,   // llamadas a operator new
+    NUM_CONTADORES
+};
+
+const char *const NOMBRES_CONTADORES[NUM_CONTADORES] = {
+    "nodos", "vecinos", "empujes_reflejo", "intentos", "repintados", "reservas"};
+
+std::atomic<uint64_t> contadoresMotor[NUM_CONTADORES];
+
+struct ContadoresMotor
+{
+    uint64_t valor[NUM_CONTADORES] = {};
+
+    ContadoresMotor operator-(const ContadoresMotor &o) const
+    {
+        ContadoresMotor d;
+        for (int i = 0; i < NUM_CONTADORES; ++i)
+            d.valor[i] = valor[i] - o.valor[i];
+        return d;
+    }
+};
+
+ContadoresMotor leerContadores()
+{
+    ContadoresMotor c;
+    for (int i = 0; i < NUM_CONTADORES; ++i)
+        c.valor[i] = contadoresMotor[i].load(std::memory_order_relaxed);
+    return c;
+}
+
+inline void contar(ContadorMotor c, uint64_t n = 1)
+{
+    contadoresMotor[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+struct ContadorLocal
+{
+    ContadorMotor cual;
+    uint64_t n = 0;
+
+    explicit ContadorLocal(ContadorMotor c) : cual(c) {}
+    ~ContadorLocal()
+    {
+        if (n)
+            contar(cual, n);
+    }
+    void operator++() { ++n; }
+
+    ContadorLocal(const ContadorLocal &) = delete;
+    ContadorLocal &operator=(const ContadorLocal &) = delete;
+};
+
+// Reservas contadas: sustituye el operator new de todo el programa
+void *operator new(std::size_t n)
+{
+    contar(CONT_RESERVAS);
+    if (void *p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+// GCC no ve que el new de arriba también usa malloc
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+#pragma GCC diagnostic pop
+
+// Histograma de tiempos en microsegundos con cubetas log-lineales: 32 por
+// potencia de dos, así que cualquier percentil sale con menos de un 3% de
+// error sin guardar las muestras. Cubre hasta 2^40 us.
+struct HistogramaTiempos
+{
+    static const int SUB = 5;
+    static const int CUBETAS = (40 - SUB + 1) << SUB;
+
+    uint32_t cuenta[CUBETAS] = {};
+    uint64_t total = 0;
+    uint64_t maximo = 0;
+    uint64_t suma = 0;
+
+    static int cubeta(uint64_t us)
+    {
+        if (us < (1u << SUB))
+            return int(us);
+        int e = 63 - __builtin_clzll(us);
+        return std::min(((e - SUB + 1) << SUB) + int(us >> (e - SUB)) - (1 << SUB), CUBETAS - 1);
+    }
+
+    // Límite inferior de la cubeta
+    static uint64_t valorDe(int i)
+    {
+        if (i < (1 << SUB))
+            return i;
+        int e = (i >> SUB) + SUB - 1;
+        return uint64_t((i & ((1 << SUB) - 1)) + (1 << SUB)) << (e - SUB);
+    }
+
+    void anotar(uint64_t us)
+    {
+        ++cuenta[cubeta(us)];
+        ++total;
+        suma += us;
+        maximo = std::max(maximo, us);
+    }
+
+    void anotarMs(double ms)
+    {
+        anotar(uint64_t(std::max(ms, 0.0) * 1000));
+    }
+
+    // En milisegundos, con el punto medio de la cubeta
+    double percentil(double p) const
+    {
+        if (total == 0)
+            return 0;
+        uint64_t objetivo = std::max<uint64_t>(1, uint64_t(std::ceil(p / 100 * total)));
+        uint64_t acumulado = 0;
+        for (int i = 0; i < CUBETAS; ++i)
+        {
+            acumulado += cuenta[i];
+            if (acumulado >= objetivo)
+                return std::min((valorDe(i) + valorDe(i + 1)) / 2.0, double(maximo)) / 1000;
+        }
+        return maximo / 1000.0;
+    }
+
+    std::string resumen() const
+    {
+        char linea[96];
+        std::snprintf(linea, sizeof(linea), "p50 %.1f  p95 %.1f  p99 %.1f ms (n=%llu)", percentil(50),
+                      percentil(95), percentil(99), (unsigned long long)total);
+        return linea;
+    }
+
+    // Resumen completo en texto: percentiles y luego las cubetas no vacías
+    // (límite inferior en us y cuenta), para comparar sesiones
+    void escribir(std::ostream &out) const
+    {
+        out << "muestras " << total << "\n";
+        out << "media_ms " << (total ? suma / 1000.0 / total : 0) << "\n";
+        for (double p : {50.0, 90.0, 99.0, 99.9})
+            out << "p" << p << "_ms " << percentil(p) << "\n";
+        out << "max_ms " << maximo / 1000.0 << "\n";
+        out << "cubetas_us\n";
+        for (int i = 0; i < CUBETAS; ++i)
+        {
+            if (cuenta[i])
+                out << valorDe(i) << " " << cuenta[i] << "\n";
+        }
+    }
+};
+
+// Perfil por fases del bucle principal y de las llamadas al motor. Apagado,
+// cada temporizador cuesta leer un bool; encendido, dos lecturas del reloj.
+// Solo se usa desde el hilo principal.
+enum FaseFrame : int
+{
+    FASE_FRAME,
+    FASE_EVENTOS,
+    FASE_SIMULACION,
+    FASE_SOLUCIONADOR,
+    FASE_HOVER,
+    FASE_PREVISTA,
+    FASE_TEXTOS,
+    FASE_DIBUJO,
+    FASE_PRESENTAR,
+    FASE_PROPAGAR,
+    FASE_CAMINO,
+    NUM_FASES
+};
+
+const char *const NOMBRES_FASES[NUM_FASES] = {
+    "Frame", "Eventos", "Simulacion", "Solucionador", "Hover", "Prevista",
+    "Textos", "Dibujo", "Presentar", " Propagar", " Camino"};
+
+struct PerfilFrames
+{
+    static const int VENTANA = 128;
+
+    bool activo = false;
+    double actual[NUM_FASES] = {};
+    float muestras[NUM_FASES][VENTANA] = {};
+    ContadoresMotor alEmpezar;
+    uint64_t trabajo[NUM_CONTADORES][VENTANA] = {};
+    int frames = 0;
+
+    void encender(bool si)
+    {
+        activo = si;
+        frames = 0;
+        std::fill(actual, actual + NUM_FASES, 0.0);
+        alEmpezar = leerContadores();
+    }
+
+    void cerrarFrame()
+    {
+        if (!activo)
+            return;
+        int pos = frames % VENTANA;
+        for (int f = 0; f < NUM_FASES; ++f)
+        {
+            muestras[f][pos] = float(actual[f]);
+            actual[f] = 0;
+        }
+        ContadoresMotor ahora = leerContadores(), delta = ahora - alEmpezar;
+        for (int i = 0; i < NUM_CONTADORES; ++i)
+            trabajo[i][pos] = delta.valor[i];
+        alEmpezar = ahora;
+        ++frames;
+    }
+
+    int cantidad() const
+    {
+        return std::min(frames, VENTANA);
+    }
+
+    double media(int f) const
+    {
+        int n = cantidad();
+        double suma = 0;
+        for (int i = 0; i < n; ++i)
+            suma += muestras[f][i];
+        return n ? suma / n : 0;
+    }
+
+    double p99(int f) const
+    {
+        int n = cantidad();
+        if (n == 0)
+            return 0;
+        float copia[VENTANA];
+        std::copy(muestras[f], muestras[f] + n, copia);
+        int k = n * 99 / 100;
+        std::nth_element(copia, copia + k, copia + n);
+        return copia[k];
+    }
+
+    // Una línea por fase: media y p99 en milisegundos. Las fases con
+    // sangría son llamadas al motor, ya incluidas en las de arriba.
+    std::string resumen() const
+    {
+        std::string texto = "Fase       media / p99 ms\n";
+        char linea[64];
+        for (int f = 0; f < NUM_FASES; ++f)
+        {
+            std::snprintf(linea, sizeof(linea), "%-12s %6.2f / %6.2f\n", NOMBRES_FASES[f], media(f), p99(f));
+            texto += linea;
+        }
+        texto += "\nTrabajo por frame  media / max\n";
+        int n = cantidad();
+        for (int i = 0; i < NUM_CONTADORES; ++i)
+        {
+            uint64_t suma = 0, maximo = 0;
+            for (int k = 0; k < n; ++k)
+            {
+                suma += trabajo[i][k];
+                maximo = std::max(maximo, trabajo[i][k]);
+            }
+            std::snprintf(linea, sizeof(linea), "%-12s %8llu / %llu\n", NOMBRES_CONTADORES[i],
+                          (unsigned long long)(n ? suma / n : 0), (unsigned long long)maximo);
+            texto += linea;
+        }
+        return texto;
+    }
+};
+PerfilFrames perfilFrames;
+
+struct TemporizadorFase
+{
+    FaseFrame fase;
+    bool activo;
+    std::chrono::steady_clock::time_point inicio;
+
+    explicit TemporizadorFase(FaseFrame f) : fase(f), activo(perfilFrames.activo)
+    {
+        if (activo)
+            inicio = std::chrono::steady_clock::now();
+    }
+
+    ~TemporizadorFase()
+    {
+        cerrar();
+    }
+
+    void cerrar()
+    {
+        if (activo)
+            perfilFrames.actual[fase] +=
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - inicio).count();
+        activo = false;
+    }
+
+    // Cierra la fase en curso y abre la siguiente con una sola lectura del reloj
+    void siguiente(FaseFrame f)
+    {
+        if (activo)
+        {
+            auto ahora = std::chrono::steady_clock::now();
+            perfilFrames.actual[fase] += std::chrono::duration<double, std::milli>(ahora - inicio).count();
+            inicio = ahora;
+        }
+        fase = f;
+    }
+
+    TemporizadorFase(const TemporizadorFase &) = delete;
+    TemporizadorFase &operator=(const TemporizadorFase &) = delete;
+};
+
+// Traza de eventos (formato "trace event" de Chrome, se abre en Perfetto o
+// chrome://tracing). Cada hilo escribe inicios y finales de tramo en su
+// propio anillo sin cerrojos; el volcado los lee mientras siguen escribiendo
+// y descarta lo que pudo pisarse a medias. Los anillos de los hilos que
+// terminan pasan al siguiente hilo que se crea: cada anillo es un carril.
+const auto origenTraza = std::chrono::steady_clock::now();
+std::atomic<bool> trazaActiva{false};
+
+struct BufferTraza
+{
+    static const uint64_t CAPACIDAD = 1 << 15;
+
+    struct Evento
+    {
+        std::atomic<const char *> nombre{nullptr};
+        std::atomic<uint64_t> marca{0}; // ns desde origenTraza << 1 | es final
+    };
+
+    Evento eventos[CAPACIDAD];
+    std::atomic<uint64_t> escritos{0};
+    int carril = 0;
+
+    // Solo lo llama el hilo dueño del anillo
+    void anotar(const char *nombre, bool fin)
+    {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - origenTraza)
+                          .count();
+        uint64_t n = escritos.load(std::memory_order_relaxed);
+        Evento &e = eventos[n & (CAPACIDAD - 1)];
+        // release: quien lea el hueco ya pisado verá también "escritos" >= n
+        e.nombre.store(nombre, std::memory_order_release);
+        e.marca.store(ns << 1 | uint64_t(fin), std::memory_order_release);
+        escritos.store(n + 1, std::memory_order_release);
+    }
+};
+
+struct RegistroTrazas
+{
+    sf::Mutex cerrojo;
+    std::vector<std::unique_ptr<BufferTraza>> buffers;
+    std::vector<BufferTraza *> libres;
+
+    BufferTraza *tomar()
+    {
+        sf::Lock lock(cerrojo);
+        if (!libres.empty())
+        {
+            BufferTraza *b = libres.back();
+            libres.pop_back();
+            return b;
+        }
+        buffers.emplace_back(new BufferTraza());
+        buffers.back()->carril = (int)buffers.size();
+        return buffers.back().get();
+    }
+
+    void soltar(BufferTraza *b)
+    {
+        sf::Lock lock(cerrojo);
+        libres.push_back(b);
+    }
+
+    bool volcar(const std::string &ruta)
+    {
+        std::ofstream out(ruta, std::ios::binary);
+        if (!out)
+            return false;
+        out << "{\"traceEvents\":[";
+        bool primero = true;
+        char linea[256];
+        sf::Lock lock(cerrojo);
+        std::vector<std::pair<const char *, uint64_t>> copia;
+        for (auto &b : buffers)
+        {
+            uint64_t hasta = b->escritos.load(std::memory_order_acquire);
+            uint64_t desde = hasta > BufferTraza::CAPACIDAD ? hasta - BufferTraza::CAPACIDAD : 0;
+            copia.clear();
+            for (uint64_t i = desde; i < hasta; ++i)
+            {
+                const BufferTraza::Evento &e = b->eventos[i & (BufferTraza::CAPACIDAD - 1)];
+                // acquire: la relectura de "escritos" no puede adelantarse a la copia
+                copia.emplace_back(e.nombre.load(std::memory_order_acquire), e.marca.load(std::memory_order_acquire));
+            }
+            // Lo que el dueño escribió mientras copiábamos pudo pisar los más
+            // viejos, y el hueco "ahora" puede estar a medio escribir: el primero
+            // seguro es ahora + 1 - CAPACIDAD
+            uint64_t ahora = b->escritos.load(std::memory_order_acquire);
+            uint64_t validos = ahora + 1 > BufferTraza::CAPACIDAD ? ahora + 1 - BufferTraza::CAPACIDAD : 0;
+            for (uint64_t i = std::max(desde, validos); i < hasta; ++i)
+            {
+                const auto &e = copia[i - desde];
+                if (!e.first)
+                    continue;
+                std::snprintf(linea, sizeof(linea), "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+                              primero ? "" : ",", e.first, (e.second & 1) ? 'E' : 'B', (e.second >> 1) / 1000.0,
+                              b->carril);
+                out << linea;
+                primero = false;
+            }
+        }
+        out << "\n]}\n";
+        return bool(out);
+    }
+};
+RegistroTrazas registroTrazas;
+
+// Devuelve el anillo al registro cuando el hilo termina
+struct HiloTraza
+{
+    BufferTraza *buffer = nullptr;
+
+    ~HiloTraza()
+    {
+        if (buffer)
+            registroTrazas.soltar(buffer);
+    }
+};
+thread_local HiloTraza hiloTraza;
+
+inline void anotarTraza(const char *nombre, bool fin)
+{
+    if (!hiloTraza.buffer)
+        hiloTraza.buffer = registroTrazas.tomar();
+    hiloTraza.buffer->anotar(nombre, fin);
+}
+
+// Tramo con nombre (un literal: se guarda el puntero) mientras dura el ámbito
+struct TramoTraza
+{
+    const char *nombre;
+    bool activo;
+
+    explicit TramoTraza(const char *n) : nombre(n), activo(trazaActiva.load(std::memory_order_relaxed))
+    {
+        if (activo)
+            anotarTraza(nombre, false);
+    }
+
+    ~TramoTraza()
+    {
+        if (activo)
+            anotarTraza(nombre, true);
+    }
+
+    TramoTraza(const TramoTraza &) = delete;
+    TramoTraza &operator=(const TramoTraza &) = delete;
+};
+
+// Generador aleatorio del motor (xoshiro256**). Se siembra de forma explícita
+// para poder reproducir partidas; cada hilo de trabajo usa su propio flujo,
+// separado de los demás por saltos de 2^128 pasos.
+struct GeneradorAleatorio
+{
+    uint64_t s[4];
+
+    explicit GeneradorAleatorio(uint64_t semilla = 0, int flujo = 0)
+    {
+        // splitmix64 para repartir la semilla por los 256 bits de estado
+        for (auto &x : s)
+        {
+            semilla += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = semilla;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            x = z ^ (z >> 31);
+        }
+        for (int i = 0; i < flujo; ++i)
+            saltar();
+    }
+
+    static uint64_t rotar(uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t siguiente()
+    {
+        uint64_t resultado = rotar(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotar(s[3], 45);
+        return resultado;
+    }
+
+    // Equivale a 2^128 llamadas a siguiente()
+    void saltar()
+    {
+        static const uint64_t SALTO[] = {0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL,
+                                         0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL};
+        uint64_t t[4] = {0, 0, 0, 0};
+        for (uint64_t salto : SALTO)
+        {
+            for (int b = 0; b < 64; ++b)
+            {
+                if (salto & (1ULL << b))
+                {
+                    for (int i = 0; i < 4; ++i)
+                        t[i] ^= s[i];
+                }
+                siguiente();
+            }
+        }
+        for (int i = 0; i < 4; ++i)
+            s[i] = t[i];
+    }
+
+    // Entero uniforme en [0, n) sin sesgo (método de Lemire)
+    uint32_t acotado(uint32_t n)
+    {
+        uint64_t m = uint64_t(uint32_t(siguiente() >> 32)) * n;
+        uint32_t bajo = uint32_t(m);
+        if (bajo < n)
+        {
+            uint32_t umbral = -n % n;
+            while (bajo < umbral)
+            {
+                m = uint64_t(uint32_t(siguiente() >> 32)) * n;
+                bajo = uint32_t(m);
+            }
+        }
+        return uint32_t(m >> 32);
+    }
+};
+
+// Flujo de cada hilo de trabajo; el 0 es el de la partida
+const int FLUJO_SOLUCIONADOR = 1;
+
+// Orden de las celdas en memoria. Con Teselas el tablero se guarda en bloques
+// de TAM_TESELA x TAM_TESELA (en orden Morton dentro de cada bloque completo),
+// de modo que los vecinos verticales quedan cerca en memoria.
+enum class Disposicion
+{
+    Filas,
+    Teselas
+};
+const int TAM_TESELA = 8;
+Disposicion disposicionCeldas = Disposicion::Filas;
+
+unsigned int separarBits(unsigned int x)
+{
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+unsigned int juntarBits(unsigned int x)
+{
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0F0F0F0F;
+    x = (x | (x >> 4)) & 0x00FF00FF;
+    x = (x | (x >> 8)) & 0x0000FFFF;
+    return x;
+}
+
+// Única función que traduce (fila, columna) a posición en el vector de celdas
+int indiceCelda(int r, int c, int rows, int cols)
+{
+    if (r < 0 || r >= rows || c < 0 || c >= cols)
+        return -1;
+    if (disposicionCeldas == Disposicion::Filas)
+        return r * cols + c;
+
+    int tr = r / TAM_TESELA, tc = c / TAM_TESELA;
+    int lr = r % TAM_TESELA, lc = c % TAM_TESELA;
+    int h = std::min(TAM_TESELA, rows - tr * TAM_TESELA);
+    int w = std::min(TAM_TESELA, cols - tc * TAM_TESELA);
+    int base = tr * TAM_TESELA * cols + tc * TAM_TESELA * h;
+    if (h == TAM_TESELA && w == TAM_TESELA)
+        return base + (separarBits(lc) | (separarBits(lr) << 1));
+    return base + lr * w + lc; // teselas incompletas del borde: por filas
+}
+
+// Inversa de indiceCelda
+void celdaDeIndice(int idx, int rows, int cols, int &r, int &c)
+{
+    if (disposicionCeldas == Disposicion::Filas)
+    {
+        r = idx / cols;
+        c = idx % cols;
+        return;
+    }
+    int tr = idx / (TAM_TESELA * cols);
+    int resto = idx - tr * TAM_TESELA * cols;
+    int h = std::min(TAM_TESELA, rows - tr * TAM_TESELA);
+    int tc = resto / (TAM_TESELA * h);
+    int w = std::min(TAM_TESELA, cols - tc * TAM_TESELA);
+    int l = resto - tc * TAM_TESELA * h;
+    if (h == TAM_TESELA && w == TAM_TESELA)
+    {
+        r = tr * TAM_TESELA + juntarBits(l >> 1);
+        c = tc * TAM_TESELA + juntarBits(l);
+    }
+    else
+    {
+        r = tr * TAM_TESELA + l / w;
+        c = tc * TAM_TESELA + l % w;
+    }
+}
+
+// Topologías de vecindad. Cada una trae sus tablas de vecinos como constexpr,
+// una por paridad de celda (triángulo hacia arriba/abajo o fila par/impar en
+// hexágonos), para que los bucles calientes se instancien y desenrollen por
+// topología. "opuesto" es el vecino en dirección contraria (-1 si no existe),
+// que es donde cae el reflejo de un cristal.
+struct Vecino
+{
+    int dr, dc, opuesto;
+};
+
+enum class Topologia
+{
+    Cuadrada4,
+    Triangulo3,
+    Triangulo12,
+    Hexagonal
+};
+Topologia topologiaMapa = Topologia::Cuadrada4;
+
+constexpr int absoluto(int x)
+{
+    return x < 0 ? -x : x;
+}
+
+// Cuatro vecinos ortogonales (comportamiento original del juego)
+struct Cuadrada4
+{
+    static constexpr int N = 4;
+    static constexpr Vecino vecinos[2][N] = {
+        {{0, -1, 1}, {0, 1, 0}, {-1, 0, 3}, {1, 0, 2}},
+        {{0, -1, 1}, {0, 1, 0}, {-1, 0, 3}, {1, 0, 2}}};
+    static constexpr int paridad(int, int) { return 0; }
+    static constexpr int cota(int dr, int dc) { return absoluto(dr) + absoluto(dc); }
+};
+
+// Triángulos que comparten lado: izquierda, derecha y la base (abajo si el
+// triángulo apunta hacia arriba, arriba si apunta hacia abajo)
+struct Triangulo3
+{
+    static constexpr int N = 3;
+    static constexpr Vecino vecinos[2][N] = {
+        {{0, -1, 1}, {0, 1, 0}, {1, 0, -1}},
+        {{0, -1, 1}, {0, 1, 0}, {-1, 0, -1}}};
+    static constexpr int paridad(int r, int c) { return (r + c) & 1; }
+    static constexpr int cota(int dr, int dc) { return absoluto(dr) + absoluto(dc); }
+};
+
+// Triángulos que comparten algún vértice: 4 en la fila, 3 del lado del
+// vértice superior/inferior y 5 del lado de la base
+struct Triangulo12
+{
+    static constexpr int N = 12;
+    static constexpr Vecino vecinos[2][N] = {
+        {{0, -1, 1}, {0, 1, 0}, {0, -2, 3}, {0, 2, 2}, {-1, -1, 9}, {-1, 0, 8}, {-1, 1, 7}, {1, -1, 6}, {1, 0, 5}, {1, 1, 4}, {1, -2, -1}, {1, 2, -1}},
+        {{0, -1, 1}, {0, 1, 0}, {0, -2, 3}, {0, 2, 2}, {1, -1, 9}, {1, 0, 8}, {1, 1, 7}, {-1, -1, 6}, {-1, 0, 5}, {-1, 1, 4}, {-1, -2, -1}, {-1, 2, -1}}};
+    static constexpr int paridad(int r, int c) { return (r + c) & 1; }
+    static constexpr int cota(int dr, int dc) { return std::max(absoluto(dr), (absoluto(dc) + 1) / 2); }
+};
+
+// Hexágonos en coordenadas "odd-r": las filas impares van desplazadas media celda
+struct Hexagonal
+{
+    static constexpr int N = 6;
+    static constexpr Vecino vecinos[2][N] = {
+        {{0, -1, 1}, {0, 1, 0}, {-1, -1, 5}, {-1, 0, 4}, {1, -1, 3}, {1, 0, 2}},
+        {{0, -1, 1}, {0, 1, 0}, {-1, 0, 5}, {-1, 1, 4}, {1, 0, 3}, {1, 1, 2}}};
+    static constexpr int paridad(int r, int) { return r & 1; }
+    static constexpr int cota(int dr, int dc) { return std::max(absoluto(dr), absoluto(dc)); }
+};
+
+// Llama a f con un objeto del tipo de la topología indicada
+template <typename F>
+void conTopologia(Topologia topologia, F &&f)
+{
+    switch (topologia)
+    {
+    case Topologia::Cuadrada4:
+        f(Cuadrada4{});
+        break;
+    case Topologia::Triangulo3:
+        f(Triangulo3{});
+        break;
+    case Topologia::Triangulo12:
+        f(Triangulo12{});
+        break;
+    case Topologia::Hexagonal:
+        f(Hexagonal{});
+        break;
+    }
+}
+
+// Igual, con la topología del mapa
+template <typename F>
+void conTopologia(F &&f)
+{
+    conTopologia(topologiaMapa, std::forward<F>(f));
+}
+
 struct TriCell
 {
     sf::ConvexShape triangle;
@@ -45,9 +797,21 @@ struct TriCell
         triangle.setOutlineColor(sf::Color::Black);
     }
 
-    void updateHover(const sf::Vector2f &mousePos)
+    bool contiene(const sf::Vector2f &p) const
+    {
+        float d[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            sf::Vector2f a = triangle.getPoint(k), b = triangle.getPoint((k + 1) % 3);
+            d[k] = (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+        }
+        bool negativo = d[0] < 0 || d[1] < 0 || d[2] < 0, positivo = d[0] > 0 || d[1] > 0 || d[2] > 0;
+        return !(negativo && positivo);
+    }
+
+    void updateHover(bool hovered)
     {
-        if (triangle.getGlobalBounds().contains(mousePos))
+        if (hovered)
         {
             isHovered = true;
             triangle.setFillColor(sf::Color::Yellow);
@@ -71,151 +835,3551 @@ struct TriCell
     }
 };
 
-void propagateReflection(std::vector<TriCell> &grid, int startRow, int startCol, int rows, int cols)
+// Búsqueda jerárquica (HPA*) para mapas muy grandes: el mapa se divide en
+// clusters de TAM_CLUSTER x TAM_CLUSTER, se precalculan las distancias entre
+// entradas de cada cluster y se busca primero sobre ese grafo abstracto.
+const int TAM_CLUSTER = 16;
+const int UMBRAL_JERARQUICO = 1 << 16; // celdas a partir de las que se usa HPA*
+
+bool esTransitable(const TriCell &cell)
 {
-    auto getIndex = [&](int r, int c) -> int
+    return cell.isCrystal || cell.isExit;
+}
+
+struct Cluster
+{
+    bool sucio = true;
+    std::vector<int> entradas;   // índices de celda en el borde del cluster
+    std::vector<int> distancias; // matriz entradas x entradas, -1 si no hay conexión
+};
+
+struct JerarquiaCaminos
+{
+    int rows, cols;
+    int clusterRows, clusterCols;
+    std::vector<Cluster> clusters;
+
+    JerarquiaCaminos(int r, int c)
+        : rows(r), cols(c),
+          clusterRows((r + TAM_CLUSTER - 1) / TAM_CLUSTER),
+          clusterCols((c + TAM_CLUSTER - 1) / TAM_CLUSTER),
+          clusters(clusterRows * clusterCols)
+    {
+    }
+
+    int clusterDe(int r, int c) const
+    {
+        return (r / TAM_CLUSTER) * clusterCols + c / TAM_CLUSTER;
+    }
+
+    // Una celda cambió: se invalida su cluster y los de cualquier celda que
+    // pueda tenerla como vecina (como mucho una fila y dos columnas)
+    void marcarCelda(int r, int c)
+    {
+        int kr0 = std::max(r - 1, 0) / TAM_CLUSTER, kr1 = std::min(r + 1, rows - 1) / TAM_CLUSTER;
+        int kc0 = std::max(c - 2, 0) / TAM_CLUSTER, kc1 = std::min(c + 2, cols - 1) / TAM_CLUSTER;
+        for (int kr = kr0; kr <= kr1; ++kr)
+            for (int kc = kc0; kc <= kc1; ++kc)
+                clusters[kr * clusterCols + kc].sucio = true;
+    }
+
+    void marcarTodo()
+    {
+        for (auto &k : clusters)
+            k.sucio = true;
+    }
+
+    // BFS limitada al cluster k desde la celda origen. Devuelve distancias (y
+    // padres, si se piden) en coordenadas locales del cluster.
+    template <typename Topo>
+    void bfsEnCluster(const std::vector<TriCell> &grid, int k, int origen,
+                      std::vector<int> &dist, std::vector<int> *padre = nullptr) const
+    {
+        int r0 = (k / clusterCols) * TAM_CLUSTER, c0 = (k % clusterCols) * TAM_CLUSTER;
+        int h = std::min(TAM_CLUSTER, rows - r0), w = std::min(TAM_CLUSTER, cols - c0);
+        dist.assign(h * w, -1);
+        if (padre)
+            padre->assign(h * w, -1);
+        std::queue<int> q;
+        int lo = celdaALocal(k, grid[origen].row, grid[origen].col);
+        dist[lo] = 0;
+        q.push(lo);
+        ContadorLocal nodos(CONT_NODOS), examinados(CONT_VECINOS);
+        while (!q.empty())
+        {
+            int l = q.front();
+            q.pop();
+            ++nodos;
+            int lr = l / w, lc = l % w;
+            const auto &vecinos = Topo::vecinos[Topo::paridad(r0 + lr, c0 + lc)];
+            for (int v = 0; v < Topo::N; ++v)
+            {
+                ++examinados;
+                int nr = lr + vecinos[v].dr, nc = lc + vecinos[v].dc;
+                if (nr < 0 || nr >= h || nc < 0 || nc >= w)
+                    continue;
+                int nl = nr * w + nc;
+                if (dist[nl] != -1 || !esTransitable(grid[indiceCelda(r0 + nr, c0 + nc, rows, cols)]))
+                    continue;
+                dist[nl] = dist[l] + 1;
+                if (padre)
+                    (*padre)[nl] = l;
+                q.push(nl);
+            }
+        }
+    }
+
+    int localACelda(int k, int l) const
+    {
+        int r0 = (k / clusterCols) * TAM_CLUSTER, c0 = (k % clusterCols) * TAM_CLUSTER;
+        int w = std::min(TAM_CLUSTER, cols - c0);
+        return indiceCelda(r0 + l / w, c0 + l % w, rows, cols);
+    }
+
+    int celdaALocal(int k, int r, int c) const
+    {
+        int r0 = (k / clusterCols) * TAM_CLUSTER, c0 = (k % clusterCols) * TAM_CLUSTER;
+        int w = std::min(TAM_CLUSTER, cols - c0);
+        return (r - r0) * w + (c - c0);
+    }
+
+    // Entradas: celdas transitables con algún vecino transitable en otro cluster
+    template <typename Topo>
+    void reconstruirCluster(const std::vector<TriCell> &grid, int k)
+    {
+        Cluster &cl = clusters[k];
+        int r0 = (k / clusterCols) * TAM_CLUSTER, c0 = (k % clusterCols) * TAM_CLUSTER;
+        int h = std::min(TAM_CLUSTER, rows - r0), w = std::min(TAM_CLUSTER, cols - c0);
+
+        cl.entradas.clear();
+        for (int r = r0; r < r0 + h; ++r)
+        {
+            for (int c = c0; c < c0 + w; ++c)
+            {
+                int idx = indiceCelda(r, c, rows, cols);
+                if (!esTransitable(grid[idx]))
+                    continue;
+                for (const Vecino &v : Topo::vecinos[Topo::paridad(r, c)])
+                {
+                    int ni = indiceCelda(r + v.dr, c + v.dc, rows, cols);
+                    if (ni != -1 && clusterDe(r + v.dr, c + v.dc) != k && esTransitable(grid[ni]))
+                    {
+                        cl.entradas.push_back(idx);
+                        break;
+                    }
+                }
+            }
+        }
+        std::sort(cl.entradas.begin(), cl.entradas.end());
+
+        int n = cl.entradas.size();
+        cl.distancias.assign(n * n, -1);
+        std::vector<int> dist;
+        for (int i = 0; i < n; ++i)
+        {
+            bfsEnCluster<Topo>(grid, k, cl.entradas[i], dist);
+            for (int j = 0; j < n; ++j)
+            {
+                const TriCell &e = grid[cl.entradas[j]];
+                cl.distancias[i * n + j] = dist[celdaALocal(k, e.row, e.col)];
+            }
+        }
+        cl.sucio = false;
+    }
+
+    template <typename Topo>
+    void actualizar(const std::vector<TriCell> &grid)
+    {
+        for (int k = 0; k < (int)clusters.size(); ++k)
+        {
+            if (clusters[k].sucio)
+                reconstruirCluster<Topo>(grid, k);
+        }
+    }
+
+    int indiceEntrada(int k, int idx) const
+    {
+        const auto &e = clusters[k].entradas;
+        auto it = std::lower_bound(e.begin(), e.end(), idx);
+        return (it != e.end() && *it == idx) ? int(it - e.begin()) : -1;
+    }
+};
+
+// Celdas agrupadas por estado (libre, cristal, bloqueada, salida) con alta y
+// baja en O(1) y muestreo uniforme, para colocar salida y bloqueos sin tanteos.
+enum class EstadoCelda
+{
+    Libre,
+    Cristal,
+    Bloqueada,
+    Salida
+};
+const int NUM_ESTADOS = 4;
+
+EstadoCelda estadoDe(const TriCell &cell)
+{
+    if (cell.isExit)
+        return EstadoCelda::Salida;
+    if (cell.isBlocked)
+        return EstadoCelda::Bloqueada;
+    if (cell.isCrystal)
+        return EstadoCelda::Cristal;
+    return EstadoCelda::Libre;
+}
+
+struct IndiceEstados
+{
+    std::vector<int> celdas[NUM_ESTADOS];
+    std::vector<int> posicion; // posición de cada celda dentro de su lista
+    std::vector<EstadoCelda> estado;
+
+    void reconstruir(const std::vector<TriCell> &grid)
+    {
+        for (auto &lista : celdas)
+            lista.clear();
+        posicion.resize(grid.size());
+        estado.resize(grid.size());
+        for (int i = 0; i < (int)grid.size(); ++i)
+        {
+            estado[i] = estadoDe(grid[i]);
+            auto &lista = celdas[(int)estado[i]];
+            posicion[i] = lista.size();
+            lista.push_back(i);
+        }
+    }
+
+    void actualizar(int idx, EstadoCelda nuevo)
     {
-        if (r < 0 || r >= rows || c < 0 || c >= cols)
+        if (estado[idx] == nuevo)
+            return;
+        // Baja: el último de la lista ocupa el hueco
+        auto &vieja = celdas[(int)estado[idx]];
+        int ultimo = vieja.back();
+        vieja[posicion[idx]] = ultimo;
+        posicion[ultimo] = posicion[idx];
+        vieja.pop_back();
+
+        auto &nueva = celdas[(int)nuevo];
+        posicion[idx] = nueva.size();
+        nueva.push_back(idx);
+        estado[idx] = nuevo;
+    }
+
+    int cantidad(EstadoCelda e) const
+    {
+        return celdas[(int)e].size();
+    }
+
+    // Celda uniforme entre las de los estados pedidos, -1 si no hay ninguna
+    int muestrear(GeneradorAleatorio &rng, std::initializer_list<EstadoCelda> estados) const
+    {
+        int total = 0;
+        for (EstadoCelda e : estados)
+            total += cantidad(e);
+        if (total == 0)
             return -1;
-        return r * cols + c;
+        int k = rng.acotado(total);
+        for (EstadoCelda e : estados)
+        {
+            if (k < cantidad(e))
+                return celdas[(int)e][k];
+            k -= cantidad(e);
+        }
+        return -1;
+    }
+};
+
+// Estado de una celda en un byte, sin el camino (que se deriva)
+enum BanderaCelda : uint8_t
+{
+    BANDERA_CRISTAL = 1,
+    BANDERA_REFLEJO = 2,
+    BANDERA_SALIDA = 4,
+    BANDERA_BLOQUEO = 8
+};
+
+uint8_t banderasDe(const TriCell &cell)
+{
+    return uint8_t((cell.isCrystal ? BANDERA_CRISTAL : 0) | (cell.isReflected ? BANDERA_REFLEJO : 0) |
+                   (cell.isExit ? BANDERA_SALIDA : 0) | (cell.isBlocked ? BANDERA_BLOQUEO : 0));
+}
+
+void aplicarBanderas(TriCell &cell, uint8_t b)
+{
+    cell.isCrystal = b & BANDERA_CRISTAL;
+    cell.isReflected = b & BANDERA_REFLEJO;
+    cell.isExit = b & BANDERA_SALIDA;
+    cell.isBlocked = b & BANDERA_BLOQUEO;
+}
+
+// Banderas de todas las celdas (en orden de grid) repartidas en trozos
+// compartidos. Copiar una instantánea solo copia un puntero; la primera
+// escritura duplica el directorio de trozos y cada trozo se duplica la primera
+// vez que se escribe en él. Para saber qué es propio no se mira el contador de
+// referencias (leerlo mientras otro hilo suelta su copia sería una carrera):
+// cada instantánea tiene una época, que cambia en ella y en su copia al
+// copiar, y solo se escribe en sitio en lo creado con la época actual. Una
+// instantánea la usa un hilo cada vez, pero sus copias pueden pasar a otros.
+const int BITS_TROZO = 12; // 4096 celdas por trozo
+std::atomic<uint64_t> siguienteEpocaCow{1};
+
+struct TableroCow
+{
+    struct Trozo
+    {
+        uint64_t epoca;
+        std::array<uint8_t, 1 << BITS_TROZO> banderas;
+    };
+    struct Directorio
+    {
+        uint64_t epoca;
+        std::vector<std::shared_ptr<Trozo>> trozos;
+    };
+    std::shared_ptr<Directorio> directorio;
+    size_t tam = 0;
+    mutable uint64_t epoca = siguienteEpocaCow++;
+
+    TableroCow() = default;
+    TableroCow(TableroCow &&) = default;
+    TableroCow &operator=(TableroCow &&) = default;
+
+    TableroCow(const TableroCow &o) : directorio(o.directorio), tam(o.tam)
+    {
+        o.epoca = siguienteEpocaCow++;
+    }
+
+    TableroCow &operator=(const TableroCow &o)
+    {
+        directorio = o.directorio;
+        tam = o.tam;
+        epoca = siguienteEpocaCow++;
+        o.epoca = siguienteEpocaCow++;
+        return *this;
+    }
+
+    void reiniciar(const std::vector<TriCell> &grid)
+    {
+        tam = grid.size();
+        directorio = std::make_shared<Directorio>();
+        directorio->epoca = epoca;
+        directorio->trozos.resize((tam + (1 << BITS_TROZO) - 1) >> BITS_TROZO);
+        for (size_t t = 0; t < directorio->trozos.size(); ++t)
+        {
+            auto trozo = std::make_shared<Trozo>();
+            trozo->epoca = epoca;
+            trozo->banderas.fill(0);
+            for (size_t j = 0; j < trozo->banderas.size() && (t << BITS_TROZO) + j < tam; ++j)
+                trozo->banderas[j] = banderasDe(grid[(t << BITS_TROZO) + j]);
+            directorio->trozos[t] = std::move(trozo);
+        }
+    }
+
+    uint8_t operator[](size_t i) const
+    {
+        return directorio->trozos[i >> BITS_TROZO]->banderas[i & ((1 << BITS_TROZO) - 1)];
+    }
+
+    void poner(size_t i, uint8_t b)
+    {
+        if ((*this)[i] == b)
+            return;
+        if (directorio->epoca != epoca)
+        {
+            directorio = std::make_shared<Directorio>(*directorio);
+            directorio->epoca = epoca;
+        }
+        auto &trozo = directorio->trozos[i >> BITS_TROZO];
+        if (trozo->epoca != epoca)
+        {
+            trozo = std::make_shared<Trozo>(*trozo);
+            trozo->epoca = epoca;
+        }
+        trozo->banderas[i & ((1 << BITS_TROZO) - 1)] = b;
+    }
+
+    // Interfaz de propagarReflejos
+    uint8_t banderas(int idx) const { return (*this)[idx]; }
+    void reflejar(int idx) { poner(idx, (*this)[idx] | BANDERA_CRISTAL | BANDERA_REFLEJO); }
+    bool cancelado() const { return false; }
+};
+
+// Historial para deshacer: cada acción guarda solo las celdas que cambió
+// (banderas antes y después), incluidas las de la cascada de reflejos y las
+// del evento de turno. La sombra lleva las banderas ya anotadas de cada celda
+// para saber el "antes" sin copiar el tablero, y sirve a la vez de
+// instantánea del tablero vivo.
+
+struct CambioCelda
+{
+    uint32_t idx;
+    uint8_t antes, despues;
+};
+
+// Lo que no está en las celdas y también se deshace
+struct EstadoPartida
+{
+    int turnCounter, exitIndex;
+    uint32_t topologia;
+    uint64_t semilla;
+    uint64_t rng[4];
+
+    bool operator==(const EstadoPartida &o) const
+    {
+        return turnCounter == o.turnCounter && exitIndex == o.exitIndex && topologia == o.topologia &&
+               semilla == o.semilla && std::equal(rng, rng + 4, o.rng);
+    }
+};
+
+struct AccionRegistrada
+{
+    size_t inicio, fin; // rango en RegistroCambios::cambios
+    EstadoPartida antes, despues;
+};
+
+struct RegistroCambios
+{
+    TableroCow sombra;
+    std::vector<CambioCelda> cambios;   // acciones consecutivas, las deshechas al final
+    std::deque<AccionRegistrada> acciones;
+    size_t hechas = 0;                  // acciones[hechas..] se pueden rehacer
+    std::vector<CambioCelda> abiertos;  // cambios de la acción en curso
+    bool accionAbierta = false;
+    EstadoPartida estadoInicial{};
+    size_t limiteBytes = 64 << 20;
+    uint64_t version = 0; // sube con cada cambio de celda
+
+    void reiniciar(const std::vector<TriCell> &grid)
+    {
+        sombra.reiniciar(grid);
+        ++version;
+        cambios.clear();
+        acciones.clear();
+        abiertos.clear();
+        hechas = 0;
+        accionAbierta = false;
+    }
+
+    void anotar(const std::vector<TriCell> &grid, int idx)
+    {
+        uint8_t b = banderasDe(grid[idx]);
+        if (b == sombra[idx])
+            return;
+        if (accionAbierta)
+            abiertos.push_back({uint32_t(idx), sombra[idx], b});
+        sombra.poner(idx, b);
+        ++version;
+    }
+
+    void anotarTodo(const std::vector<TriCell> &grid)
+    {
+        for (int i = 0; i < (int)grid.size(); ++i)
+            anotar(grid, i);
+    }
+
+    void iniciar(const EstadoPartida &estado)
+    {
+        accionAbierta = true;
+        estadoInicial = estado;
+        abiertos.clear();
+    }
+
+    void cerrar(const EstadoPartida &estado)
+    {
+        accionAbierta = false;
+        // Varias pasadas por la misma celda quedan en una: el primer "antes"
+        // y el último "después"
+        std::stable_sort(abiertos.begin(), abiertos.end(),
+                         [](const CambioCelda &a, const CambioCelda &b) { return a.idx < b.idx; });
+        size_t n = 0;
+        for (size_t i = 0; i < abiertos.size();)
+        {
+            size_t j = i;
+            while (j + 1 < abiertos.size() && abiertos[j + 1].idx == abiertos[i].idx)
+                ++j;
+            if (abiertos[i].antes != abiertos[j].despues)
+                abiertos[n++] = {abiertos[i].idx, abiertos[i].antes, abiertos[j].despues};
+            i = j + 1;
+        }
+        abiertos.resize(n);
+        if (n == 0 && estado == estadoInicial)
+            return;
+
+        // Una acción nueva descarta lo que se podía rehacer
+        acciones.resize(hechas);
+        cambios.resize(acciones.empty() ? 0 : acciones.back().fin);
+        size_t inicio = cambios.size();
+        cambios.insert(cambios.end(), abiertos.begin(), abiertos.end());
+        acciones.push_back({inicio, cambios.size(), estadoInicial, estado});
+        hechas = acciones.size();
+        abiertos = std::vector<CambioCelda>();
+        compactar();
+    }
+
+    size_t bytes() const
+    {
+        return cambios.size() * sizeof(CambioCelda) + acciones.size() * sizeof(AccionRegistrada);
+    }
+
+    // Por encima del límite se olvidan las acciones más antiguas hasta bajar a
+    // la mitad, para no mover el historial en cada acción. La última se
+    // conserva aunque sola supere el límite.
+    void compactar()
+    {
+        if (bytes() <= limiteBytes)
+            return;
+        size_t olvidar = 0, liberado = 0;
+        while (olvidar + 1 < acciones.size() && bytes() - liberado > limiteBytes / 2)
+        {
+            const AccionRegistrada &a = acciones[olvidar++];
+            liberado += (a.fin - a.inicio) * sizeof(CambioCelda) + sizeof(AccionRegistrada);
+        }
+        size_t desplazamiento = acciones[olvidar].inicio;
+        acciones.erase(acciones.begin(), acciones.begin() + olvidar);
+        cambios.erase(cambios.begin(), cambios.begin() + desplazamiento);
+        for (auto &a : acciones)
+        {
+            a.inicio -= desplazamiento;
+            a.fin -= desplazamiento;
+        }
+        hechas -= std::min(hechas, olvidar);
+        cambios.shrink_to_fit();
+    }
+
+    bool puedeDeshacer() const { return !accionAbierta && hechas > 0; }
+    bool puedeRehacer() const { return !accionAbierta && hechas < acciones.size(); }
+};
+
+// Estructuras derivadas del tablero que hay que avisar cuando cambia una celda
+struct IndicesMapa
+{
+    int rows, cols;
+    JerarquiaCaminos jerarquia;
+    IndiceEstados estados;
+    RegistroCambios *registro = nullptr;
+    // El camino sale del primer cristal manual por índice; se siguen al
+    // cambiar cada celda para no recorrer el tablero en cada búsqueda
+    std::set<int> manuales;
+    // Celdas que marcó la última búsqueda. Tras reconstruir no se sabe qué
+    // trae el tablero y la siguiente limpieza lo recorre entero.
+    std::vector<int> camino;
+    bool caminoConocido = false;
+
+    IndicesMapa(const std::vector<TriCell> &grid, int r, int c) : rows(r), cols(c), jerarquia(r, c)
+    {
+        estados.reconstruir(grid);
+        reconstruirManuales(grid);
+    }
+
+    void celdaCambiada(const std::vector<TriCell> &grid, int idx)
+    {
+        contar(CONT_REPINTADOS);
+        jerarquia.marcarCelda(grid[idx].row, grid[idx].col);
+        estados.actualizar(idx, estadoDe(grid[idx]));
+        if (grid[idx].isCrystal && !grid[idx].isReflected)
+            manuales.insert(idx);
+        else
+            manuales.erase(idx);
+        if (registro)
+            registro->anotar(grid, idx);
+    }
+
+    void reconstruirManuales(const std::vector<TriCell> &grid)
+    {
+        manuales.clear();
+        for (int i = 0; i < (int)grid.size(); ++i)
+        {
+            if (grid[i].isCrystal && !grid[i].isReflected)
+                manuales.insert(manuales.end(), i);
+        }
+    }
+
+    int origenCamino() const
+    {
+        return manuales.empty() ? -1 : *manuales.begin();
+    }
+
+    void limpiarCamino(std::vector<TriCell> &grid)
+    {
+        if (caminoConocido)
+        {
+            for (int idx : camino)
+                grid[idx].isPath = false;
+        }
+        else
+        {
+            for (auto &cell : grid)
+                cell.isPath = false;
+        }
+        camino.clear();
+        caminoConocido = true;
+    }
+
+    void celdaCambiada(const std::vector<TriCell> &grid, const TriCell &cell)
+    {
+        celdaCambiada(grid, indiceCelda(cell.row, cell.col, rows, cols));
+    }
+
+    void reconstruir(const std::vector<TriCell> &grid)
+    {
+        contar(CONT_REPINTADOS, grid.size());
+        jerarquia.marcarTodo();
+        estados.reconstruir(grid);
+        reconstruirManuales(grid);
+        caminoConocido = false;
+        if (registro)
+            registro->anotarTodo(grid);
+    }
+};
+
+// Cascada de reflejos sobre cualquier tablero que sepa dar las banderas de una
+// celda, convertirla en reflejo y decir si hay que abandonar: el tablero vivo
+// o una instantánea
+template <typename Topo, typename Tablero>
+void propagarReflejos(Tablero &tablero, int startRow, int startCol, int rows, int cols)
+{
+    auto getIndex = [&](int r, int c) -> int
+    {
+        return indiceCelda(r, c, rows, cols);
     };
     std::queue<std::pair<int, int>> queue;
     queue.push({startRow, startCol});
+    ContadorLocal nodos(CONT_NODOS), empujes(CONT_EMPUJES);
 
-    while (!queue.empty())
+    while (!queue.empty() && !tablero.cancelado())
     {
         auto [r, c] = queue.front();
         queue.pop();
+        ++nodos;
         int currentIdx = getIndex(r, c);
         if (currentIdx == -1)
             continue;
 
-        std::vector<std::pair<int, int>> directions = {{0, -1}, {0, 1}, {-1, 0}, {1, 0}};
+        const auto &vecinos = Topo::vecinos[Topo::paridad(r, c)];
+        for (int v = 0; v < Topo::N; ++v)
+        {
+            if (vecinos[v].opuesto < 0)
+                continue;
+            const Vecino &d = vecinos[v], &o = vecinos[d.opuesto];
+            int neighborIdx = getIndex(r + d.dr, c + d.dc);
+            int reflectIdx = getIndex(r + o.dr, c + o.dc);
+            if (neighborIdx != -1 && reflectIdx != -1)
+            {
+                const uint8_t ocupada = BANDERA_CRISTAL | BANDERA_SALIDA | BANDERA_BLOQUEO;
+                if ((tablero.banderas(neighborIdx) & BANDERA_CRISTAL) && !(tablero.banderas(reflectIdx) & ocupada))
+                {
+                    tablero.reflejar(reflectIdx);
+                    queue.push({r + o.dr, c + o.dc});
+                    ++empujes;
+                }
+            }
+        }
+    }
+}
+
+struct TableroVivo
+{
+    std::vector<TriCell> &grid;
+    IndicesMapa *indices;
+
+    uint8_t banderas(int idx) const { return banderasDe(grid[idx]); }
+    bool cancelado() const { return false; }
+
+    void reflejar(int idx)
+    {
+        grid[idx].isCrystal = true;
+        grid[idx].isReflected = true;
+        grid[idx].triangle.setFillColor(sf::Color(150, 255, 255));
+        if (indices)
+            indices->celdaCambiada(grid, idx);
+    }
+};
+
+template <typename Topo>
+void propagateReflection(std::vector<TriCell> &grid, int startRow, int startCol, int rows, int cols,
+                         IndicesMapa *indices)
+{
+    TableroVivo tablero{grid, indices};
+    propagarReflejos<Topo>(tablero, startRow, startCol, rows, cols);
+}
+
+void propagateReflection(std::vector<TriCell> &grid, int startRow, int startCol, int rows, int cols,
+                         IndicesMapa *indices = nullptr)
+{
+    TemporizadorFase temporizador(FASE_PROPAGAR);
+    TramoTraza tramo("propagateReflection");
+    conTopologia([&](auto topo)
+                 { propagateReflection<decltype(topo)>(grid, startRow, startCol, rows, cols, indices); });
+}
+
+// Marca el camino de start a exitIndex y anota sus celdas en "camino"; quien
+// llama elige el origen y limpia el camino anterior
+template <typename Topo>
+void buscarCaminoBFS(std::vector<TriCell> &grid, int start, int exitIndex, int rows, int cols,
+                     std::vector<int> &camino)
+{
+    auto getIndex = [&](int r, int c) -> int
+    {
+        return indiceCelda(r, c, rows, cols);
+    };
+    std::queue<int> q;
+    std::unordered_map<int, int> parent;
+    int end = exitIndex;
+    q.push(start);
+    parent[start] = -1;
+    ContadorLocal nodos(CONT_NODOS), examinados(CONT_VECINOS);
+
+    while (!q.empty())
+    {
+        int idx = q.front();
+        q.pop();
+        ++nodos;
+        int r = grid[idx].row, c = grid[idx].col;
+        if (idx == end)
+            break;
+        for (const Vecino &v : Topo::vecinos[Topo::paridad(r, c)])
+        {
+            ++examinados;
+            int ni = getIndex(r + v.dr, c + v.dc);
+            if (ni != -1 && (grid[ni].isCrystal || grid[ni].isExit) && !parent.count(ni))
+            {
+                q.push(ni);
+                parent[ni] = idx;
+            }
+        }
+    }
+
+    int node = end;
+    while (parent.count(node) && parent[node] != -1)
+    {
+        grid[node].isPath = true;
+        camino.push_back(node);
+        node = parent[node];
+    }
+}
+
+// Búsqueda completa sin índices: limpia y busca el origen recorriendo el tablero
+void buscarCaminoBFS(std::vector<TriCell> &grid, int exitIndex, int rows, int cols)
+{
+    TramoTraza tramo("buscarCaminoBFS");
+    int start = -1;
+    for (int i = 0; i < (int)grid.size(); ++i)
+    {
+        grid[i].isPath = false;
+        if (start == -1 && grid[i].isCrystal && !grid[i].isReflected)
+            start = i;
+    }
+    if (start == -1)
+        return;
+    std::vector<int> camino;
+    conTopologia([&](auto topo)
+                 { buscarCaminoBFS<decltype(topo)>(grid, start, exitIndex, rows, cols, camino); });
+}
+
+// Igual que buscarCaminoBFS, pero A* sobre el grafo de entradas y refinado
+// posterior dentro de cada cluster atravesado.
+template <typename Topo>
+void buscarCaminoJerarquico(std::vector<TriCell> &grid, JerarquiaCaminos &jer, int start, int exitIndex, int rows,
+                            int cols, std::vector<int> &camino)
+{
+    int end = exitIndex;
+    jer.actualizar<Topo>(grid);
+    int ks = jer.clusterDe(grid[start].row, grid[start].col);
+    int ke = jer.clusterDe(grid[end].row, grid[end].col);
+
+    // Distancias locales desde el origen y hacia la salida dentro de sus clusters
+    std::vector<int> distInicio, distFin;
+    jer.bfsEnCluster<Topo>(grid, ks, start, distInicio);
+    jer.bfsEnCluster<Topo>(grid, ke, end, distFin);
+
+    auto heuristica = [&](int idx) -> int
+    {
+        return Topo::cota(grid[end].row - grid[idx].row, grid[end].col - grid[idx].col);
+    };
+    auto local = [&](int k, int idx) -> int
+    {
+        return jer.celdaALocal(k, grid[idx].row, grid[idx].col);
+    };
+
+    std::unordered_map<int, int> coste, parent;
+    std::priority_queue<std::pair<int, int>, std::vector<std::pair<int, int>>, std::greater<>> abiertos;
+    coste[start] = 0;
+    parent[start] = -1;
+    abiertos.push({heuristica(start), start});
+    ContadorLocal nodos(CONT_NODOS), examinados(CONT_VECINOS);
+
+    auto relajar = [&](int desde, int hacia, int d)
+    {
+        ++examinados;
+        int nuevo = coste[desde] + d;
+        auto it = coste.find(hacia);
+        if (it == coste.end() || nuevo < it->second)
+        {
+            coste[hacia] = nuevo;
+            parent[hacia] = desde;
+            abiertos.push({nuevo + heuristica(hacia), hacia});
+        }
+    };
+
+    while (!abiertos.empty())
+    {
+        auto [f, idx] = abiertos.top();
+        abiertos.pop();
+        if (f - heuristica(idx) > coste[idx])
+            continue;
+        ++nodos;
+        if (idx == end)
+            break;
+
+        int k = jer.clusterDe(grid[idx].row, grid[idx].col);
+        const Cluster &cl = jer.clusters[k];
+        int n = cl.entradas.size();
+
+        if (idx == start)
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                int d = distInicio[local(k, cl.entradas[j])];
+                if (d > 0)
+                    relajar(idx, cl.entradas[j], d);
+            }
+        }
+        else
+        {
+            int e = jer.indiceEntrada(k, idx);
+            for (int j = 0; j < n; ++j)
+            {
+                int d = cl.distancias[e * n + j];
+                if (d > 0)
+                    relajar(idx, cl.entradas[j], d);
+            }
+        }
+        if (k == ke && distFin[local(k, idx)] > 0)
+            relajar(idx, end, distFin[local(k, idx)]);
+
+        // Saltos a entradas adyacentes de otros clusters
+        int r = grid[idx].row, c = grid[idx].col;
+        for (const Vecino &v : Topo::vecinos[Topo::paridad(r, c)])
+        {
+            int ni = indiceCelda(r + v.dr, c + v.dc, rows, cols);
+            if (ni == -1)
+                continue;
+            int kn = jer.clusterDe(r + v.dr, c + v.dc);
+            if (kn != k && jer.indiceEntrada(kn, ni) != -1)
+                relajar(idx, ni, 1);
+        }
+    }
+
+    if (!parent.count(end))
+        return;
+
+    // Refinado: cada tramo abstracto dentro de un cluster se rehace con BFS local
+    std::vector<int> dist, padreLocal;
+    int node = end;
+    while (parent[node] != -1)
+    {
+        int prev = parent[node];
+        int k = jer.clusterDe(grid[node].row, grid[node].col);
+        if (k != jer.clusterDe(grid[prev].row, grid[prev].col))
+        {
+            grid[node].isPath = true;
+            camino.push_back(node);
+        }
+        else
+        {
+            jer.bfsEnCluster<Topo>(grid, k, prev, dist, &padreLocal);
+            for (int l = local(k, node); padreLocal[l] != -1; l = padreLocal[l])
+            {
+                grid[jer.localACelda(k, l)].isPath = true;
+                camino.push_back(jer.localACelda(k, l));
+            }
+        }
+        node = prev;
+    }
+}
+
+// Solo toca las celdas del camino anterior y del nuevo
+void buscarCamino(std::vector<TriCell> &grid, IndicesMapa &indices, int exitIndex, int rows, int cols)
+{
+    TemporizadorFase temporizador(FASE_CAMINO);
+    TramoTraza tramo("buscarCamino");
+    indices.limpiarCamino(grid);
+    int start = indices.origenCamino();
+    if (start == -1)
+        return;
+    if ((int)grid.size() >= UMBRAL_JERARQUICO)
+        conTopologia(
+            [&](auto topo)
+            {
+                buscarCaminoJerarquico<decltype(topo)>(grid, indices.jerarquia, start, exitIndex, rows, cols,
+                                                       indices.camino);
+            });
+    else
+        conTopologia([&](auto topo)
+                     { buscarCaminoBFS<decltype(topo)>(grid, start, exitIndex, rows, cols, indices.camino); });
+}
+
+// Solo conectividad, sin marcar el camino, sobre una instantánea: 0 si desde
+// "desde" se llega a "hasta", y si no la menor cota de distancia a "hasta"
+// entre las celdas alcanzadas. -1 si se cancela a medias.
+template <typename Topo>
+int distanciaAlcanzada(const TableroCow &tablero, int desde, int hasta, int rows, int cols,
+                       const std::atomic<bool> &cancelar)
+{
+    int hr, hc;
+    celdaDeIndice(hasta, rows, cols, hr, hc);
+    std::vector<bool> visitada(tablero.tam, false);
+    std::queue<int> q;
+    q.push(desde);
+    visitada[desde] = true;
+    int mejor = INT32_MAX;
+    ContadorLocal nodos(CONT_NODOS), examinados(CONT_VECINOS);
+    for (int n = 0; !q.empty(); ++n)
+    {
+        if (n % 4096 == 0 && cancelar)
+            return -1;
+        int idx = q.front();
+        q.pop();
+        ++nodos;
+        if (idx == hasta)
+            return 0;
+        int r, c;
+        celdaDeIndice(idx, rows, cols, r, c);
+        mejor = std::min(mejor, Topo::cota(hr - r, hc - c));
+        for (const Vecino &v : Topo::vecinos[Topo::paridad(r, c)])
+        {
+            ++examinados;
+            int ni = indiceCelda(r + v.dr, c + v.dc, rows, cols);
+            if (ni != -1 && !visitada[ni] && (tablero[ni] & (BANDERA_CRISTAL | BANDERA_SALIDA)))
+            {
+                visitada[ni] = true;
+                q.push(ni);
+            }
+        }
+    }
+    return std::max(mejor, 1);
+}
+
+char codigoCelda(const TriCell &cell)
+{
+    if (cell.isExit)
+        return 'S';
+    if (cell.isPath)
+        return 'P';
+    if (cell.isBlocked)
+        return 'X';
+    if (cell.isCrystal && cell.isReflected)
+        return 'R';
+    if (cell.isCrystal)
+        return 'M';
+    return '.';
+}
+
+// Instantánea del tablero para exportar: un código por celda en orden de filas
+std::vector<char> capturarCodigos(const std::vector<TriCell> &grid, int cols)
+{
+    std::vector<char> codigos(grid.size());
+    for (const auto &cell : grid)
+        codigos[cell.row * cols + cell.col] = codigoCelda(cell);
+    return codigos;
+}
+
+// Da formato a las filas en bloques grandes y los escribe de una vez.
+// filasEscritas, si se pasa, se va actualizando para informar del progreso.
+bool escribirCodigos(const std::string &ruta, const std::vector<char> &codigos, int rows, int cols,
+                     std::atomic<int> *filasEscritas = nullptr)
+{
+    std::ofstream outFile(ruta, std::ios::binary);
+    if (!outFile.is_open())
+        return false;
+
+    const size_t TAM_BLOQUE = 4 << 20;
+    const size_t bytesFila = size_t(cols) * 2 + 1;
+    std::vector<char> bloque(std::max(TAM_BLOQUE, bytesFila));
+    size_t usado = 0;
+    for (int r = 0; r < rows; ++r)
+    {
+        if (usado + bytesFila > bloque.size())
+        {
+            outFile.write(bloque.data(), usado);
+            usado = 0;
+        }
+        const char *fila = codigos.data() + size_t(r) * cols;
+        char *out = bloque.data() + usado;
+        for (int c = 0; c < cols; ++c)
+        {
+            *out++ = fila[c];
+            *out++ = ' ';
+        }
+        *out++ = '\n';
+        usado += bytesFila;
+        if (filasEscritas)
+            filasEscritas->store(r + 1, std::memory_order_relaxed);
+    }
+    outFile.write(bloque.data(), usado);
+    return bool(outFile);
+}
+
+void exportarEstadoMapa(const std::vector<TriCell> &grid, int rows, int cols,
+                        const std::string &ruta = "estado_mapa.txt")
+{
+    escribirCodigos(ruta, capturarCodigos(grid, cols), rows, cols);
+}
+
+// Exportación en un hilo aparte: el hilo de la ventana solo copia los códigos
+struct ExportacionTexto
+{
+    std::string ruta;
+    int rows = 0, cols = 0;
+    std::vector<char> codigos;
+    std::atomic<int> filasEscritas{0};
+    std::atomic<bool> enCurso{false};
+    bool ok = false;
+    sf::Thread hilo;
+
+    ExportacionTexto() : hilo(&ExportacionTexto::ejecutar, this) {}
+
+    bool iniciar(const std::vector<TriCell> &grid, int r, int c, const std::string &destino)
+    {
+        if (enCurso)
+            return false;
+        hilo.wait();
+        ruta = destino;
+        rows = r;
+        cols = c;
+        codigos = capturarCodigos(grid, cols);
+        filasEscritas = 0;
+        enCurso = true;
+        hilo.launch();
+        return true;
+    }
+
+    void ejecutar()
+    {
+        TramoTraza tramo("exportar");
+        ok = escribirCodigos(ruta, codigos, rows, cols, &filasEscritas);
+        codigos = std::vector<char>();
+        enCurso = false;
+    }
+
+    int porcentaje() const
+    {
+        return rows > 0 ? int(100LL * filasEscritas / rows) : 0;
+    }
+};
+
+// Formato binario de mapa: cabecera fija seguida de un plano de bits por
+// propiedad de celda (en orden de filas, rellenado a palabras de 64 bits).
+// Se carga proyectando el archivo en memoria, sin interpretar nada más que la
+// cabecera, y se guarda con una sola escritura.
+const char MAGIA_MAPA[4] = {'C', 'C', 'M', 'B'};
+const uint32_t VERSION_MAPA = 1;
+
+enum PlanoMapa
+{
+    PLANO_CRISTAL,
+    PLANO_REFLEJO,
+    PLANO_BLOQUEO,
+    NUM_PLANOS
+};
+
+struct CabeceraMapa
+{
+    char magia[4];
+    uint32_t version;
+    uint32_t rows, cols;
+    uint32_t exitRow, exitCol;
+    uint32_t turnCounter;
+    uint32_t topologia;
+    uint64_t semilla;
+    uint64_t estadoRng[4];
+};
+
+static_assert(sizeof(CabeceraMapa) % 8 == 0, "los planos deben quedar alineados a 64 bits");
+
+// Los planos se reservan enteros antes de leer el contenido (y un mapa
+// comprimido puede ocupar muy poco), así que el tamaño se acota aquí; los
+// índices de celda además son int
+const uint64_t MAX_CELDAS_MAPA = 1ULL << 28;
+
+bool cabeceraValida(const CabeceraMapa &cab)
+{
+    return cab.rows > 0 && cab.cols > 0 && uint64_t(cab.rows) * cab.cols <= MAX_CELDAS_MAPA &&
+           cab.exitRow < cab.rows && cab.exitCol < cab.cols && cab.topologia <= uint32_t(Topologia::Hexagonal);
+}
+
+uint64_t palabrasPorPlano(uint32_t rows, uint32_t cols)
+{
+    return (uint64_t(rows) * cols + 63) / 64;
+}
+
+// Archivo de solo lectura proyectado en memoria
+struct ArchivoMapeado
+{
+    const unsigned char *datos = nullptr;
+    size_t tam = 0;
+#ifdef _WIN32
+    HANDLE archivo = INVALID_HANDLE_VALUE, proyeccion = nullptr;
+#endif
+
+    ArchivoMapeado() = default;
+    ArchivoMapeado(const ArchivoMapeado &) = delete;
+    ArchivoMapeado &operator=(const ArchivoMapeado &) = delete;
+    ~ArchivoMapeado() { cerrar(); }
+
+    bool abrir(const std::string &ruta)
+    {
+        cerrar();
+#ifdef _WIN32
+        archivo = CreateFileA(ruta.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (archivo == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER t;
+        GetFileSizeEx(archivo, &t);
+        tam = size_t(t.QuadPart);
+        if (tam == 0)
+            return true;
+        proyeccion = CreateFileMappingA(archivo, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!proyeccion)
+            return false;
+        datos = static_cast<const unsigned char *>(MapViewOfFile(proyeccion, FILE_MAP_READ, 0, 0, 0));
+#else
+        int fd = open(ruta.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        fstat(fd, &st);
+        tam = size_t(st.st_size);
+        if (tam > 0)
+        {
+            void *p = mmap(nullptr, tam, PROT_READ, MAP_PRIVATE, fd, 0);
+            datos = p == MAP_FAILED ? nullptr : static_cast<const unsigned char *>(p);
+        }
+        close(fd);
+        if (tam == 0)
+            return true;
+#endif
+        return datos != nullptr;
+    }
+
+    void cerrar()
+    {
+#ifdef _WIN32
+        if (datos)
+            UnmapViewOfFile(datos);
+        if (proyeccion)
+            CloseHandle(proyeccion);
+        if (archivo != INVALID_HANDLE_VALUE)
+            CloseHandle(archivo);
+        archivo = INVALID_HANDLE_VALUE;
+        proyeccion = nullptr;
+#else
+        if (datos)
+            munmap(const_cast<unsigned char *>(datos), tam);
+#endif
+        datos = nullptr;
+        tam = 0;
+    }
+};
+
+// Vista directa sobre un mapa binario proyectado: los planos se leen en sitio.
+// Si el archivo venía comprimido, los planos se descomprimen en planosPropios.
+struct MapaBinario
+{
+    ArchivoMapeado archivo;
+    const CabeceraMapa *cabecera = nullptr;
+    const uint64_t *planos[NUM_PLANOS] = {};
+    CabeceraMapa cabeceraPropia;
+    std::vector<uint64_t> planosPropios;
+
+    bool celda(int plano, int r, int c) const
+    {
+        uint64_t bit = uint64_t(r) * cabecera->cols + c;
+        return (planos[plano][bit / 64] >> (bit % 64)) & 1;
+    }
+};
+
+// Empaqueta las propiedades de cada celda en NUM_PLANOS planos de bits
+void empaquetarPlanos(const std::vector<TriCell> &grid, int cols, uint64_t palabras, uint64_t *planos)
+{
+    for (const auto &cell : grid)
+    {
+        uint64_t bit = uint64_t(cell.row) * cols + cell.col;
+        uint64_t mascara = 1ULL << (bit % 64);
+        if (cell.isCrystal)
+            planos[PLANO_CRISTAL * palabras + bit / 64] |= mascara;
+        if (cell.isReflected)
+            planos[PLANO_REFLEJO * palabras + bit / 64] |= mascara;
+        if (cell.isBlocked)
+            planos[PLANO_BLOQUEO * palabras + bit / 64] |= mascara;
+    }
+}
+
+// Codificación comprimida: la misma cabecera (con magia CCMZ) y, por plano,
+// un byte de codificación, la longitud en varint y los datos. Para cada plano
+// se elige la más corta entre el plano crudo, longitudes de rachas alternas
+// de ceros y unos, o la lista de posiciones de los bits a uno (en deltas).
+const char MAGIA_COMPRIMIDO[4] = {'C', 'C', 'M', 'Z'};
+
+enum CodificacionPlano : uint8_t
+{
+    PLANO_CRUDO,
+    PLANO_RACHAS,
+    PLANO_DISPERSO
+};
+
+void escribirVarint(std::vector<uint8_t> &out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back(uint8_t(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(uint8_t(v));
+}
+
+bool leerVarint(const uint8_t *&p, const uint8_t *fin, uint64_t &v)
+{
+    v = 0;
+    for (int desplazamiento = 0; p < fin && desplazamiento < 64; desplazamiento += 7)
+    {
+        uint8_t b = *p++;
+        v |= uint64_t(b & 0x7F) << desplazamiento;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Primera posición >= pos cuyo bit no vale "valor" (o total si no hay)
+uint64_t siguienteCambio(const uint64_t *plano, uint64_t total, uint64_t pos, bool valor)
+{
+    if (pos >= total)
+        return total;
+    const uint64_t invertir = valor ? ~0ULL : 0;
+    uint64_t w = pos / 64;
+    uint64_t palabra = (plano[w] ^ invertir) & (~0ULL << (pos % 64));
+    while (palabra == 0)
+    {
+        if (++w * 64 >= total)
+            return total;
+        palabra = plano[w] ^ invertir;
+    }
+    return std::min(total, w * 64 + __builtin_ctzll(palabra));
+}
+
+// Pone a uno los bits [desde, hasta)
+void rellenarBits(uint64_t *plano, uint64_t desde, uint64_t hasta)
+{
+    while (desde < hasta)
+    {
+        uint64_t w = desde / 64, b = desde % 64;
+        uint64_t n = std::min<uint64_t>(64 - b, hasta - desde);
+        plano[w] |= (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << b;
+        desde += n;
+    }
+}
+
+// Los codificadores abandonan (devuelven false) en cuanto la salida alcanza
+// "limite" bytes: en planos ruidosos no compensa terminar una codificación
+// que ya es más larga que la mejor encontrada
+bool codificarRachas(const uint64_t *plano, uint64_t total, size_t limite, std::vector<uint8_t> &out)
+{
+    bool valor = false;
+    for (uint64_t pos = 0; pos < total; valor = !valor)
+    {
+        uint64_t fin = siguienteCambio(plano, total, pos, valor);
+        escribirVarint(out, fin - pos);
+        if (out.size() >= limite)
+            return false;
+        pos = fin;
+    }
+    return true;
+}
+
+bool codificarDisperso(const uint64_t *plano, uint64_t palabras, size_t limite, std::vector<uint8_t> &out)
+{
+    uint64_t siguiente = 0;
+    for (uint64_t w = 0; w < palabras; ++w)
+    {
+        for (uint64_t palabra = plano[w]; palabra; palabra &= palabra - 1)
+        {
+            uint64_t pos = w * 64 + __builtin_ctzll(palabra);
+            escribirVarint(out, pos - siguiente);
+            siguiente = pos + 1;
+        }
+        if (out.size() >= limite)
+            return false;
+    }
+    return true;
+}
+
+std::vector<uint8_t> comprimirMapa(const CabeceraMapa &cabecera, const uint64_t *planos)
+{
+    uint64_t total = uint64_t(cabecera.rows) * cabecera.cols;
+    uint64_t palabras = palabrasPorPlano(cabecera.rows, cabecera.cols);
+
+    std::vector<uint8_t> out(sizeof(CabeceraMapa));
+    std::memcpy(out.data(), &cabecera, sizeof(CabeceraMapa));
+    std::memcpy(out.data(), MAGIA_COMPRIMIDO, 4);
+
+    std::vector<uint8_t> rachas, disperso;
+    for (int i = 0; i < NUM_PLANOS; ++i)
+    {
+        const uint64_t *plano = planos + i * palabras;
+        rachas.clear();
+        disperso.clear();
+
+        uint8_t codificacion = PLANO_CRUDO;
+        const uint8_t *datos = reinterpret_cast<const uint8_t *>(plano);
+        size_t tam = palabras * 8;
+        if (codificarRachas(plano, total, tam, rachas))
+        {
+            codificacion = PLANO_RACHAS;
+            datos = rachas.data();
+            tam = rachas.size();
+        }
+        if (codificarDisperso(plano, palabras, tam, disperso))
+        {
+            codificacion = PLANO_DISPERSO;
+            datos = disperso.data();
+            tam = disperso.size();
+        }
+        out.push_back(codificacion);
+        escribirVarint(out, tam);
+        out.insert(out.end(), datos, datos + tam);
+    }
+    return out;
+}
+
+bool descomprimirMapa(const uint8_t *datos, size_t tam, MapaBinario &mapa)
+{
+    if (tam < sizeof(CabeceraMapa))
+        return false;
+    std::memcpy(&mapa.cabeceraPropia, datos, sizeof(CabeceraMapa));
+    mapa.cabecera = &mapa.cabeceraPropia;
+    const CabeceraMapa &cab = mapa.cabeceraPropia;
+    if (std::memcmp(cab.magia, MAGIA_COMPRIMIDO, 4) != 0 || cab.version != VERSION_MAPA || !cabeceraValida(cab))
+        return false;
+
+    uint64_t total = uint64_t(cab.rows) * cab.cols;
+    uint64_t palabras = palabrasPorPlano(cab.rows, cab.cols);
+    mapa.planosPropios.assign(NUM_PLANOS * palabras, 0);
+
+    const uint8_t *p = datos + sizeof(CabeceraMapa), *fin = datos + tam;
+    for (int i = 0; i < NUM_PLANOS; ++i)
+    {
+        uint64_t *plano = mapa.planosPropios.data() + i * palabras;
+        mapa.planos[i] = plano;
+        uint64_t largo;
+        if (p >= fin)
+            return false;
+        uint8_t codificacion = *p++;
+        if (!leerVarint(p, fin, largo) || largo > uint64_t(fin - p))
+            return false;
+        const uint8_t *finPlano = p + largo;
+
+        if (codificacion == PLANO_CRUDO)
+        {
+            if (largo != palabras * 8)
+                return false;
+            std::memcpy(plano, p, largo);
+        }
+        else if (codificacion == PLANO_RACHAS)
+        {
+            bool valor = false;
+            for (uint64_t pos = 0, n; p < finPlano; valor = !valor)
+            {
+                if (!leerVarint(p, finPlano, n) || n > total - pos)
+                    return false;
+                if (valor)
+                    rellenarBits(plano, pos, pos + n);
+                pos += n;
+            }
+        }
+        else if (codificacion == PLANO_DISPERSO)
+        {
+            for (uint64_t siguiente = 0, delta; p < finPlano;)
+            {
+                if (!leerVarint(p, finPlano, delta) || delta >= total - siguiente)
+                    return false;
+                uint64_t pos = siguiente + delta;
+                plano[pos / 64] |= 1ULL << (pos % 64);
+                siguiente = pos + 1;
+            }
+        }
+        else
+        {
+            return false;
+        }
+        p = finPlano;
+    }
+    return true;
+}
+
+bool cargarMapaBinario(const std::string &ruta, MapaBinario &mapa)
+{
+    if (!mapa.archivo.abrir(ruta) || mapa.archivo.tam < sizeof(CabeceraMapa))
+    {
+        std::cerr << "Error: No se pudo abrir el mapa " << ruta << std::endl;
+        return false;
+    }
+    if (std::memcmp(mapa.archivo.datos, MAGIA_COMPRIMIDO, 4) == 0)
+    {
+        bool ok = descomprimirMapa(mapa.archivo.datos, mapa.archivo.tam, mapa);
+        mapa.archivo.cerrar();
+        if (!ok)
+            std::cerr << "Error: " << ruta << " no es un mapa comprimido valido" << std::endl;
+        return ok;
+    }
+    mapa.cabecera = reinterpret_cast<const CabeceraMapa *>(mapa.archivo.datos);
+    const CabeceraMapa &cab = *mapa.cabecera;
+    uint64_t palabras = palabrasPorPlano(cab.rows, cab.cols);
+    if (std::memcmp(cab.magia, MAGIA_MAPA, 4) != 0 || cab.version != VERSION_MAPA || !cabeceraValida(cab) ||
+        mapa.archivo.tam < sizeof(CabeceraMapa) + NUM_PLANOS * palabras * 8)
+    {
+        std::cerr << "Error: " << ruta << " no es un mapa valido" << std::endl;
+        return false;
+    }
+    const uint64_t *p = reinterpret_cast<const uint64_t *>(mapa.archivo.datos + sizeof(CabeceraMapa));
+    for (int i = 0; i < NUM_PLANOS; ++i)
+        mapa.planos[i] = p + i * palabras;
+    return true;
+}
+
+bool guardarMapaBinario(const std::string &ruta, const std::vector<TriCell> &grid, const CabeceraMapa &cabecera)
+{
+    uint64_t palabras = palabrasPorPlano(cabecera.rows, cabecera.cols);
+    std::vector<uint64_t> buffer(sizeof(CabeceraMapa) / 8 + NUM_PLANOS * palabras, 0);
+    std::memcpy(buffer.data(), &cabecera, sizeof(CabeceraMapa));
+    empaquetarPlanos(grid, cabecera.cols, palabras, buffer.data() + sizeof(CabeceraMapa) / 8);
+
+    std::ofstream out(ruta, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size() * 8);
+    return bool(out);
+}
+
+std::vector<uint8_t> comprimirTablero(const std::vector<TriCell> &grid, const CabeceraMapa &cabecera)
+{
+    uint64_t palabras = palabrasPorPlano(cabecera.rows, cabecera.cols);
+    std::vector<uint64_t> planos(NUM_PLANOS * palabras, 0);
+    empaquetarPlanos(grid, cabecera.cols, palabras, planos.data());
+    return comprimirMapa(cabecera, planos.data());
+}
+
+bool guardarMapaComprimido(const std::string &ruta, const std::vector<TriCell> &grid, const CabeceraMapa &cabecera)
+{
+    std::vector<uint8_t> datos = comprimirTablero(grid, cabecera);
+
+    std::ofstream out(ruta, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(datos.data()), datos.size());
+    return bool(out);
+}
+
+CabeceraMapa crearCabecera(int rows, int cols, const TriCell &salida, int turnCounter,
+                           uint64_t semilla, const GeneradorAleatorio &rng)
+{
+    CabeceraMapa cab = {};
+    std::memcpy(cab.magia, MAGIA_MAPA, 4);
+    cab.version = VERSION_MAPA;
+    cab.rows = rows;
+    cab.cols = cols;
+    cab.exitRow = salida.row;
+    cab.exitCol = salida.col;
+    cab.turnCounter = turnCounter;
+    cab.topologia = uint32_t(topologiaMapa);
+    cab.semilla = semilla;
+    std::memcpy(cab.estadoRng, rng.s, sizeof(rng.s));
+    return cab;
+}
+
+// Vuelca los planos sobre un tablero de las mismas dimensiones y devuelve el
+// índice de la salida
+int aplicarMapaBinario(const MapaBinario &mapa, std::vector<TriCell> &grid)
+{
+    for (auto &cell : grid)
+    {
+        cell.isCrystal = mapa.celda(PLANO_CRISTAL, cell.row, cell.col);
+        cell.isReflected = mapa.celda(PLANO_REFLEJO, cell.row, cell.col);
+        cell.isBlocked = mapa.celda(PLANO_BLOQUEO, cell.row, cell.col);
+        cell.isExit = false;
+        cell.isPath = false;
+    }
+    int exitIndex = indiceCelda(mapa.cabecera->exitRow, mapa.cabecera->exitCol,
+                                mapa.cabecera->rows, mapa.cabecera->cols);
+    grid[exitIndex].isExit = true;
+    return exitIndex;
+}
+
+// Archivo de mapas (.cca): muchos mapas comprimidos uno tras otro, seguidos
+// de un índice de desplazamientos y un pie fijo al final del archivo.
+//   [CCMA version] [mapa 0] [mapa 1] ... [índice: n x {desplazamiento, tam}] [pie]
+// Añadir nunca modifica bytes existentes: los mapas nuevos y un índice completo
+// se escriben detrás del último pie. Un lector que ya tenga el archivo
+// proyectado sigue viendo su versión, coherente, y uno que lo abra después ve
+// la nueva. El índice anterior queda como espacio muerto, así que conviene
+// confirmar por lotes. Solo puede haber un escritor a la vez.
+const char MAGIA_ARCHIVO[4] = {'C', 'C', 'M', 'A'};
+const char MAGIA_INDICE[4] = {'C', 'C', 'M', 'I'};
+const uint32_t VERSION_ARCHIVO = 1;
+
+struct EntradaIndice
+{
+    uint64_t desplazamiento, tam;
+};
+
+struct PieArchivo
+{
+    uint64_t desplazamientoIndice;
+    uint64_t numMapas;
+    char magia[4];
+    uint32_t version;
+};
+static_assert(sizeof(PieArchivo) == 24, "el pie del archivo debe ocupar 24 bytes");
+
+struct ArchivoMapas
+{
+    ArchivoMapeado archivo;
+    const EntradaIndice *indice = nullptr;
+    uint64_t numMapas = 0;
+
+    bool abrir(const std::string &ruta)
+    {
+        indice = nullptr;
+        numMapas = 0;
+        if (!archivo.abrir(ruta))
+            return false;
+        const size_t tam = archivo.tam;
+        if (tam < 8 + sizeof(PieArchivo) || std::memcmp(archivo.datos, MAGIA_ARCHIVO, 4) != 0)
+            return false;
+        PieArchivo pie;
+        std::memcpy(&pie, archivo.datos + tam - sizeof(PieArchivo), sizeof(PieArchivo));
+        if (std::memcmp(pie.magia, MAGIA_INDICE, 4) != 0 || pie.version != VERSION_ARCHIVO ||
+            pie.desplazamientoIndice % 8 != 0 || pie.desplazamientoIndice > tam - sizeof(PieArchivo) ||
+            pie.numMapas > (tam - sizeof(PieArchivo) - pie.desplazamientoIndice) / sizeof(EntradaIndice))
+            return false;
+        indice = reinterpret_cast<const EntradaIndice *>(archivo.datos + pie.desplazamientoIndice);
+        numMapas = pie.numMapas;
+        return true;
+    }
+
+    // Solo lee la proyección, así que varios hilos pueden llamarla a la vez
+    // con su propio MapaBinario
+    bool leer(uint64_t id, MapaBinario &mapa) const
+    {
+        if (id >= numMapas)
+            return false;
+        const EntradaIndice &e = indice[id];
+        if (e.desplazamiento > archivo.tam || e.tam > archivo.tam - e.desplazamiento)
+            return false;
+        return descomprimirMapa(archivo.datos + e.desplazamiento, e.tam, mapa);
+    }
+};
+
+// Recorrido secuencial de un rango de mapas para análisis masivo. Reutilizar
+// el mismo MapaBinario evita reservar los planos en cada mapa.
+struct RecorridoArchivo
+{
+    const ArchivoMapas &archivo;
+    uint64_t siguienteId, hasta;
+
+    RecorridoArchivo(const ArchivoMapas &a, uint64_t desde = 0, uint64_t h = UINT64_MAX)
+        : archivo(a), siguienteId(desde), hasta(std::min(h, a.numMapas)) {}
+
+    // Devuelve false al terminar el rango; los mapas corruptos se saltan
+    bool siguiente(MapaBinario &mapa, uint64_t &id)
+    {
+        while (siguienteId < hasta)
+        {
+            id = siguienteId++;
+            if (archivo.leer(id, mapa))
+                return true;
+            std::cerr << "Error: mapa " << id << " del archivo corrupto" << std::endl;
+        }
+        return false;
+    }
+};
+
+struct EscritorArchivoMapas
+{
+    std::fstream out;
+    std::vector<EntradaIndice> indice;
+    uint64_t fin = 0;
+
+    // Abre un archivo existente para añadir o crea uno vacío
+    bool abrir(const std::string &ruta)
+    {
+        if (out.is_open())
+            out.close();
+        out.clear();
+        indice.clear();
+        fin = 0;
+        {
+            ArchivoMapas existente;
+            if (existente.abrir(ruta))
+            {
+                indice.assign(existente.indice, existente.indice + existente.numMapas);
+                fin = existente.archivo.tam;
+            }
+            else if (existente.archivo.tam > 0)
+            {
+                std::cerr << "Error: " << ruta << " no es un archivo de mapas" << std::endl;
+                return false;
+            }
+        }
+        if (!indice.empty() || fin > 0)
+        {
+            out.open(ruta, std::ios::binary | std::ios::in | std::ios::out);
+            return bool(out);
+        }
+        out.open(ruta, std::ios::binary | std::ios::out | std::ios::trunc);
+        uint32_t version = VERSION_ARCHIVO;
+        out.write(MAGIA_ARCHIVO, 4);
+        out.write(reinterpret_cast<const char *>(&version), 4);
+        fin = 8;
+        return bool(out);
+    }
+
+    // Devuelve el id que tendrá el mapa una vez confirmado
+    uint64_t anadir(const std::vector<uint8_t> &comprimido)
+    {
+        out.seekp(fin);
+        out.write(reinterpret_cast<const char *>(comprimido.data()), comprimido.size());
+        indice.push_back({fin, comprimido.size()});
+        fin += comprimido.size();
+        return indice.size() - 1;
+    }
+
+    // Escribe el índice y el pie; hasta entonces los lectores no ven los mapas
+    bool confirmar()
+    {
+        static const char relleno[8] = {};
+        out.seekp(fin);
+        out.write(relleno, (8 - fin % 8) % 8);
+        fin += (8 - fin % 8) % 8;
+        PieArchivo pie = {fin, indice.size(), {}, VERSION_ARCHIVO};
+        std::memcpy(pie.magia, MAGIA_INDICE, 4);
+        out.write(reinterpret_cast<const char *>(indice.data()), indice.size() * sizeof(EntradaIndice));
+        out.write(reinterpret_cast<const char *>(&pie), sizeof(pie));
+        out.flush();
+        fin += indice.size() * sizeof(EntradaIndice) + sizeof(pie);
+        return bool(out);
+    }
+};
+
+bool cargarMapaDeArchivo(const std::string &ruta, uint64_t id, MapaBinario &mapa)
+{
+    ArchivoMapas archivo;
+    if (!archivo.abrir(ruta))
+    {
+        std::cerr << "Error: No se pudo abrir el archivo de mapas " << ruta << std::endl;
+        return false;
+    }
+    if (!archivo.leer(id, mapa))
+    {
+        std::cerr << "Error: " << ruta << " no tiene un mapa valido con id " << id << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Lectura del formato de texto de exportarEstadoMapa: un código por celda
+// (S, P, X, R, M o .) separado por espacios y una fila por línea. Se recorre
+// el archivo proyectado en memoria con un único bucle, sin iostreams.
+struct MapaTexto
+{
+    int rows = 0, cols = 0;
+    int exitRow = -1, exitCol = -1;
+    std::vector<char> celdas; // en orden de filas
+};
+
+bool importarEstadoMapa(const std::string &ruta, MapaTexto &mapa)
+{
+    ArchivoMapeado archivo;
+    if (!archivo.abrir(ruta))
+    {
+        std::cerr << "Error: No se pudo abrir " << ruta << std::endl;
+        return false;
+    }
+    mapa = MapaTexto();
+    mapa.celdas.resize(archivo.tam);
+    char *salida = mapa.celdas.data();
+
+    const unsigned char *p = archivo.datos, *fin = archivo.datos + archivo.tam;
+    int colsFila = 0;
+    auto cerrarFila = [&]() -> bool
+    {
+        if (colsFila == 0)
+            return true;
+        if (mapa.rows == 0)
+            mapa.cols = colsFila;
+        else if (colsFila != mapa.cols)
+        {
+            std::cerr << "Error: la fila " << mapa.rows + 1 << " de " << ruta << " tiene " << colsFila
+                      << " celdas en lugar de " << mapa.cols << std::endl;
+            return false;
+        }
+        ++mapa.rows;
+        colsFila = 0;
+        return true;
+    };
+
+    // Clase de cada byte: la mayoría son celdas o espacios y se tratan sin
+    // saltos; los cambios de línea, la salida y los errores van aparte
+    enum : unsigned char
+    {
+        INVALIDO,
+        ESPACIO,
+        LINEA,
+        CELDA,
+        SALIDA
+    };
+    static const auto clases = []
+    {
+        std::array<unsigned char, 256> t{};
+        t[' '] = t['\t'] = t['\r'] = ESPACIO;
+        t['\n'] = LINEA;
+        t['P'] = t['X'] = t['R'] = t['M'] = t['.'] = CELDA;
+        t['S'] = SALIDA;
+        return t;
+    }();
+
+    for (; p < fin; ++p)
+    {
+        unsigned char ch = *p, clase = clases[ch];
+        *salida = char(ch);
+        salida += clase >= CELDA;
+        colsFila += clase >= CELDA;
+        if (clase == ESPACIO || clase == CELDA)
+            continue;
+
+        if (clase == LINEA)
+        {
+            if (!cerrarFila())
+                return false;
+        }
+        else if (clase == SALIDA)
+        {
+            if (mapa.exitRow != -1)
+            {
+                std::cerr << "Error: " << ruta << " tiene mas de una salida" << std::endl;
+                return false;
+            }
+            mapa.exitRow = mapa.rows;
+            mapa.exitCol = colsFila - 1;
+        }
+        else
+        {
+            std::cerr << "Error: caracter '" << ch << "' inesperado en " << ruta << " (byte "
+                      << (p - archivo.datos) << ")" << std::endl;
+            return false;
+        }
+    }
+    if (!cerrarFila())
+        return false;
+    mapa.celdas.resize(salida - mapa.celdas.data());
+    if (mapa.rows == 0 || mapa.exitRow == -1)
+    {
+        std::cerr << "Error: " << ruta << " no tiene celdas o no tiene salida" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Reconstruye el tablero (de las mismas dimensiones) y devuelve la salida.
+// Las celdas del camino (P) se toman como cristales reflejados.
+int aplicarMapaTexto(const MapaTexto &mapa, std::vector<TriCell> &grid)
+{
+    for (auto &cell : grid)
+    {
+        char ch = mapa.celdas[cell.row * mapa.cols + cell.col];
+        cell.isCrystal = ch == 'M' || ch == 'R' || ch == 'P';
+        cell.isReflected = ch == 'R' || ch == 'P';
+        cell.isBlocked = ch == 'X';
+        cell.isExit = ch == 'S';
+        cell.isPath = false;
+    }
+    return indiceCelda(mapa.exitRow, mapa.exitCol, mapa.rows, mapa.cols);
+}
+
+// Crea las celdas en el orden que marque disposicionCeldas
+std::vector<TriCell> crearGrid(int rows, int cols)
+{
+    std::vector<TriCell> grid;
+    grid.reserve(rows * cols);
+    for (int idx = 0; idx < rows * cols; ++idx)
+    {
+        int row, col;
+        celdaDeIndice(idx, rows, cols, row, col);
+        bool pointingUp = (row + col) % 2 == 0;
+        float x = col * (TRI_SIZE / 2);
+        float y = row * (TRI_SIZE / 2);
+        grid.emplace_back(x, y, pointingUp, row, col);
+    }
+    return grid;
+}
+
+// Celda bajo un punto sin recorrer el tablero: solo pueden contenerlo las dos
+// filas y dos columnas cuyo triángulo cubre esa altura y anchura. Las filas se
+// solapan media altura y se dibujan en orden, así que gana la de fila mayor.
+int celdaEnPunto(const std::vector<TriCell> &grid, const sf::Vector2f &p, int rows, int cols)
+{
+    int fila = int(std::floor(p.y / (TRI_SIZE / 2))), col = int(std::floor(p.x / (TRI_SIZE / 2)));
+    for (int r = fila; r >= fila - 1; --r)
+    {
+        for (int c = col; c >= col - 1; --c)
+        {
+            int idx = indiceCelda(r, c, rows, cols);
+            if (idx != -1 && grid[idx].contiene(p))
+                return idx;
+        }
+    }
+    return -1;
+}
+
+// Estado de una partida y acciones del jugador. La ventana solo traduce sus
+// eventos a estas llamadas, así que una partida grabada se repite sin ella.
+struct Partida
+{
+    int rows, cols;
+    uint64_t semilla;
+    GeneradorAleatorio rng;
+    std::vector<TriCell> grid;
+    IndicesMapa indices;
+    int turnCounter = 0;
+    int turnThreshold = 10;
+    int exitIndex = -1;
+    RegistroCambios registro;
+
+    Partida(int r, int c, uint64_t s)
+        : rows(r), cols(c), semilla(s), rng(s), grid(crearGrid(r, c)), indices(grid, r, c)
+    {
+        registro.reiniciar(grid);
+        indices.registro = &registro;
+    }
+
+    Partida(const Partida &) = delete;
+    Partida &operator=(const Partida &) = delete;
+
+    EstadoPartida estado() const
+    {
+        EstadoPartida e;
+        e.turnCounter = turnCounter;
+        e.exitIndex = exitIndex;
+        e.topologia = uint32_t(topologiaMapa);
+        e.semilla = semilla;
+        std::memcpy(e.rng, rng.s, sizeof(rng.s));
+        return e;
+    }
+
+    void restaurar(const EstadoPartida &e)
+    {
+        turnCounter = e.turnCounter;
+        exitIndex = e.exitIndex;
+        // Las distancias entre entradas de los clusters dependen de la topología
+        if (Topologia(e.topologia) != topologiaMapa)
+            indices.jerarquia.marcarTodo();
+        topologiaMapa = Topologia(e.topologia);
+        semilla = e.semilla;
+        std::memcpy(rng.s, e.rng, sizeof(rng.s));
+    }
+
+    // Las acciones del jugador van entre iniciarAccion y cerrarAccion para
+    // poder deshacerse
+    void iniciarAccion() { registro.iniciar(estado()); }
+    void cerrarAccion() { registro.cerrar(estado()); }
+
+    // Deshacer y rehacer recorren solo las celdas de la acción. La sombra se
+    // pone antes de avisar a los índices para que no se anote como cambio nuevo.
+    void ponerBanderas(int idx, uint8_t b)
+    {
+        aplicarBanderas(grid[idx], b);
+        registro.sombra.poner(idx, b);
+        ++registro.version;
+        indices.celdaCambiada(grid, idx);
+    }
+
+    bool deshacer()
+    {
+        if (!registro.puedeDeshacer())
+            return false;
+        const AccionRegistrada &a = registro.acciones[--registro.hechas];
+        for (size_t i = a.fin; i-- > a.inicio;)
+            ponerBanderas(registro.cambios[i].idx, registro.cambios[i].antes);
+        restaurar(a.antes);
+        actualizarCamino();
+        return true;
+    }
+
+    bool rehacer()
+    {
+        if (!registro.puedeRehacer())
+            return false;
+        const AccionRegistrada &a = registro.acciones[registro.hechas++];
+        for (size_t i = a.inicio; i < a.fin; ++i)
+            ponerBanderas(registro.cambios[i].idx, registro.cambios[i].despues);
+        restaurar(a.despues);
+        actualizarCamino();
+        return true;
+    }
+
+    void colocarSalida()
+    {
+        exitIndex = indices.estados.muestrear(rng, {EstadoCelda::Libre});
+        grid[exitIndex].isExit = true;
+        grid[exitIndex].triangle.setFillColor(sf::Color::Red);
+        indices.celdaCambiada(grid, exitIndex);
+    }
+
+    void cargar(const MapaBinario &mapa)
+    {
+        exitIndex = aplicarMapaBinario(mapa, grid);
+        turnCounter = mapa.cabecera->turnCounter;
+        semilla = mapa.cabecera->semilla;
+        topologiaMapa = Topologia(mapa.cabecera->topologia);
+        std::memcpy(rng.s, mapa.cabecera->estadoRng, sizeof(rng.s));
+        indices.reconstruir(grid);
+    }
+
+    void importar(const MapaTexto &mapa)
+    {
+        exitIndex = aplicarMapaTexto(mapa, grid);
+        indices.reconstruir(grid);
+    }
+
+    CabeceraMapa cabecera() const
+    {
+        return crearCabecera(rows, cols, grid[exitIndex], turnCounter, semilla, rng);
+    }
+
+    void actualizarCamino()
+    {
+        buscarCamino(grid, indices, exitIndex, rows, cols);
+    }
+
+    // Con "cascada" (calculada antes sobre una instantánea del mismo tablero)
+    // se aplican esas celdas en lugar de propagar; el resultado es idéntico
+    void pulsarCelda(int idx, const std::vector<int> *cascada = nullptr)
+    {
+        TriCell &cell = grid[idx];
+        if (cell.isExit || cell.isBlocked || (cell.isCrystal && cell.isReflected))
+            return;
+        cell.isCrystal = !cell.isCrystal;
+        cell.isReflected = false;
+        cell.triangle.setFillColor(cell.isCrystal ? sf::Color::Cyan : sf::Color::White);
+        indices.celdaCambiada(grid, idx);
+        ++turnCounter;
+
+        if (cell.isCrystal && cascada)
+        {
+            TableroVivo tablero{grid, &indices};
+            for (int r : *cascada)
+                tablero.reflejar(r);
+        }
+        else if (cell.isCrystal)
+        {
+            propagateReflection(grid, cell.row, cell.col, rows, cols, &indices);
+        }
+
+        if (turnCounter >= turnThreshold)
+        {
+            // La salida y los bloqueos solo caen en celdas libres
+            grid[exitIndex].isExit = false;
+            grid[exitIndex].triangle.setFillColor(sf::Color::White);
+            indices.celdaCambiada(grid, exitIndex);
+            exitIndex = indices.estados.muestrear(rng, {EstadoCelda::Libre});
+            grid[exitIndex].isExit = true;
+            grid[exitIndex].triangle.setFillColor(sf::Color::Red);
+            indices.celdaCambiada(grid, exitIndex);
+            for (int i = 0; i < 5; ++i)
+            {
+                int b = indices.estados.muestrear(rng, {EstadoCelda::Libre});
+                if (b == -1)
+                    break;
+                grid[b].isBlocked = true;
+                grid[b].triangle.setFillColor(sf::Color(50, 50, 50));
+                indices.celdaCambiada(grid, b);
+            }
+            turnCounter = 0;
+        }
+
+        actualizarCamino();
+    }
+
+    // Instantánea del tablero en O(1); no incluye el camino
+    TableroCow instantanea() const
+    {
+        return registro.sombra;
+    }
+
+    // [R]: con un cristal manual basta con buscar el camino. Si no lo hay, la
+    // búsqueda de uno (larga en tableros grandes) la hace SolucionadorFondo
+    // con una semilla sacada aquí, y su resultado llega luego con
+    // aplicarSolucion.
+    bool solucionPendiente = false;
+    uint64_t semillaSolucion = 0;
+
+    void resolver()
+    {
+        // 1. Limpiar caminos anteriores
+        indices.limpiarCamino(grid);
+
+        // 2. Verificar si ya hay cristal manual
+        if (indices.origenCamino() != -1)
+        {
+            actualizarCamino();
+            return;
+        }
+
+        // 3. Si no hay, pedir la búsqueda de uno que genere camino
+        semillaSolucion = rng.siguiente();
+        solucionPendiente = true;
+    }
+
+    // Deja como único cristal manual el de la celda elegida y su cascada
+    void aplicarSolucion(int elegido)
+    {
+        for (auto &g : grid)
+        {
+            g.isCrystal = false;
+            g.isReflected = false;
+            if (!g.isExit && !g.isBlocked)
+                g.triangle.setFillColor(sf::Color::White);
+        }
+        indices.reconstruir(grid);
+        TriCell &c = grid[elegido];
+        c.isCrystal = true;
+        c.triangle.setFillColor(sf::Color::Cyan);
+        indices.celdaCambiada(grid, elegido);
+        propagateReflection(grid, c.row, c.col, rows, cols, &indices);
+        actualizarCamino();
+    }
+
+    void limpiar()
+    {
+        for (auto &cell : grid)
+        {
+            if (!cell.isExit && !cell.isBlocked)
+            {
+                cell.isCrystal = false;
+                cell.isReflected = false;
+                cell.isPath = false;
+                cell.triangle.setFillColor(sf::Color::White);
+            }
+        }
+        indices.reconstruir(grid);
+    }
+
+    // FNV-1a de los estados en orden de filas, para comparar partidas
+    uint64_t huella() const
+    {
+        uint64_t h = 1469598103934665603ULL;
+        for (int r = 0; r < rows; ++r)
+        {
+            for (int c = 0; c < cols; ++c)
+            {
+                const TriCell &cell = grid[indiceCelda(r, c, rows, cols)];
+                h = (h ^ uint64_t(codigoCelda(cell))) * 1099511628211ULL;
+            }
+        }
+        return (h ^ uint64_t(turnCounter)) * 1099511628211ULL;
+    }
+};
+
+// Evaluación especulativa del clic: mientras el cursor está sobre una celda,
+// un hilo calcula sobre una instantánea la cascada de reflejos que provocaría
+// pulsarla, el camino resultante y si dispararía el evento de turno. Al hacer
+// clic, si el tablero no ha cambiado desde la instantánea, la cascada se
+// aplica tal cual en lugar de propagar de nuevo.
+struct Prediccion
+{
+    int celda = -1;
+    uint64_t version = 0;
+    bool disparaTurno = false;
+    std::vector<int> cascada; // celdas que se volverían reflejo, en orden
+    std::vector<int> camino;  // camino previsto (vacío si dispara el turno)
+};
+
+// Adaptador para propagarReflejos que además anota la cascada
+struct TableroEspeculativo
+{
+    TableroCow &tablero;
+    std::vector<int> &cascada;
+
+    uint8_t banderas(int idx) const { return tablero[idx]; }
+    bool cancelado() const { return false; }
+
+    void reflejar(int idx)
+    {
+        tablero.reflejar(idx);
+        cascada.push_back(idx);
+    }
+};
+
+template <typename Topo>
+void predecirClic(TableroCow &tablero, int rows, int cols, int exitIndex, Prediccion &p)
+{
+    int r, c;
+    celdaDeIndice(p.celda, rows, cols, r, c);
+    tablero.poner(p.celda, tablero[p.celda] | BANDERA_CRISTAL);
+    TableroEspeculativo especulativo{tablero, p.cascada};
+    propagarReflejos<Topo>(especulativo, r, c, rows, cols);
+    if (p.disparaTurno)
+        return;
+
+    // Mismo criterio que buscarCamino: desde el primer cristal manual
+    int inicio = -1;
+    for (size_t i = 0; i < tablero.tam && inicio == -1; ++i)
+    {
+        if ((tablero[i] & (BANDERA_CRISTAL | BANDERA_REFLEJO)) == BANDERA_CRISTAL)
+            inicio = i;
+    }
+    std::vector<int> padre(tablero.tam, -2);
+    std::queue<int> q;
+    q.push(inicio);
+    padre[inicio] = -1;
+    ContadorLocal nodos(CONT_NODOS), examinados(CONT_VECINOS);
+    while (!q.empty() && padre[exitIndex] == -2)
+    {
+        int idx = q.front();
+        q.pop();
+        ++nodos;
+        celdaDeIndice(idx, rows, cols, r, c);
+        for (const Vecino &v : Topo::vecinos[Topo::paridad(r, c)])
+        {
+            ++examinados;
+            int ni = indiceCelda(r + v.dr, c + v.dc, rows, cols);
+            if (ni != -1 && padre[ni] == -2 && (tablero[ni] & (BANDERA_CRISTAL | BANDERA_SALIDA)))
+            {
+                padre[ni] = idx;
+                q.push(ni);
+            }
+        }
+    }
+    for (int node = exitIndex; padre[node] >= 0; node = padre[node])
+        p.camino.push_back(node);
+}
+
+struct EvaluadorEspeculativo
+{
+    // Mientras enCurso, solo el hilo toca estos campos
+    TableroCow tablero;
+    int rows = 0, cols = 0, exitIndex = -1;
+    Topologia topologia = Topologia::Cuadrada4;
+    Prediccion trabajo;
+    std::atomic<bool> enCurso{false};
+    bool terminado = false;
+    sf::Thread hilo;
+
+    Prediccion prediccion; // última terminada
+
+    EvaluadorEspeculativo() : hilo(&EvaluadorEspeculativo::ejecutar, this) {}
+
+    void ejecutar()
+    {
+        TramoTraza tramo("prediccion");
+        conTopologia(topologia, [&](auto topo)
+                     { predecirClic<decltype(topo)>(tablero, rows, cols, exitIndex, trabajo); });
+        tablero = TableroCow();
+        terminado = true;
+        enCurso = false;
+    }
+
+    // Una vez por fotograma con la celda bajo el cursor (-1 si ninguna). Si el
+    // hilo está ocupado se espera al siguiente fotograma: solo cuenta la última.
+    void actualizar(const Partida &partida, int celda)
+    {
+        if (enCurso)
+            return;
+        hilo.wait();
+        if (terminado)
+        {
+            prediccion = std::move(trabajo);
+            terminado = false;
+        }
+        if (celda == -1 || valida(partida, celda))
+            return;
+        const TriCell &cell = partida.grid[celda];
+        if (cell.isExit || cell.isBlocked || cell.isCrystal)
+            return;
+
+        trabajo = Prediccion();
+        trabajo.celda = celda;
+        trabajo.version = partida.registro.version;
+        trabajo.disparaTurno = partida.turnCounter + 1 >= partida.turnThreshold;
+        tablero = partida.instantanea();
+        rows = partida.rows;
+        cols = partida.cols;
+        exitIndex = partida.exitIndex;
+        topologia = topologiaMapa;
+        enCurso = true;
+        hilo.launch();
+    }
+
+    const Prediccion *valida(const Partida &partida, int celda) const
+    {
+        if (prediccion.celda != celda || prediccion.version != partida.registro.version)
+            return nullptr;
+        return &prediccion;
+    }
+};
+
+// Solucionador de [R] en un hilo: prueba hasta 300 cristales al azar sobre
+// copias de una instantánea sin cristales y se queda con el primero que llega
+// a la salida o, si ninguno llega, con el que más se acerca. El progreso se
+// publica en atómicos sin cerrojos y el bucle principal lo consulta cada
+// fotograma. Si el tablero cambia, el bucle principal activa "cancelar" y el
+// hilo lo ve entre intentos, dentro de la cascada y dentro del BFS.
+enum EstadoSolucion : int
+{
+    SOLUCION_INACTIVA,
+    SOLUCION_EN_CURSO,
+    SOLUCION_ENCONTRADA,
+    SOLUCION_AGOTADA,
+    SOLUCION_CANCELADA
+};
+
+struct TableroCancelable
+{
+    TableroCow &tablero;
+    const std::atomic<bool> &cancelar;
+
+    uint8_t banderas(int idx) const { return tablero[idx]; }
+    void reflejar(int idx) { tablero.reflejar(idx); }
+    bool cancelado() const { return cancelar.load(std::memory_order_relaxed); }
+};
+
+struct SolucionadorFondo
+{
+    static const int MAX_INTENTOS = 300;
+
+    // Entrada: fija mientras el hilo trabaja
+    TableroCow tablero;
+    int rows = 0, cols = 0, exitIndex = -1;
+    Topologia topologia = Topologia::Cuadrada4;
+    uint64_t semilla = 0, version = 0;
+
+    // Salida
+    std::atomic<bool> cancelar{false};
+    std::atomic<int> intentos{0};
+    std::atomic<uint64_t> mejor{~0ULL}; // distancia << 32 | celda
+    std::atomic<int> estado{SOLUCION_INACTIVA};
+    bool lanzado = false;               // hay un resultado sin recoger
+    sf::Thread hilo;
+
+    SolucionadorFondo() : hilo(&SolucionadorFondo::ejecutar, this) {}
+    ~SolucionadorFondo() { cancelar = true; }
+
+    void iniciar(const Partida &partida)
+    {
+        cancelar = true;
+        hilo.wait();
+        tablero = partida.instantanea();
+        rows = partida.rows;
+        cols = partida.cols;
+        exitIndex = partida.exitIndex;
+        topologia = topologiaMapa;
+        semilla = partida.semillaSolucion;
+        version = partida.registro.version;
+        cancelar = false;
+        intentos = 0;
+        mejor = ~0ULL;
+        estado = SOLUCION_EN_CURSO;
+        lanzado = true;
+        hilo.launch();
+    }
+
+    bool enCurso() const { return estado.load(std::memory_order_acquire) == SOLUCION_EN_CURSO; }
+
+    int mejorCelda() const
+    {
+        uint64_t m = mejor.load(std::memory_order_acquire);
+        return m == ~0ULL ? -1 : int(uint32_t(m));
+    }
+
+    int mejorDistancia() const { return int(mejor.load(std::memory_order_acquire) >> 32); }
+
+    void ejecutar()
+    {
+        TramoTraza tramo("solucionador");
+        conTopologia(topologia, [&](auto topo)
+                     { estado.store(buscar<decltype(topo)>(), std::memory_order_release); });
+        tablero = TableroCow();
+    }
+
+    template <typename Topo>
+    int buscar()
+    {
+        std::vector<int> candidatas;
+        for (size_t i = 0; i < tablero.tam; ++i)
+        {
+            if (i % 65536 == 0 && cancelar)
+                return SOLUCION_CANCELADA;
+            uint8_t b = tablero[i];
+            if (b & BANDERA_CRISTAL)
+                tablero.poner(i, b & ~(BANDERA_CRISTAL | BANDERA_REFLEJO));
+            if (!(b & (BANDERA_SALIDA | BANDERA_BLOQUEO)))
+                candidatas.push_back(i);
+        }
+        if (candidatas.empty())
+            return SOLUCION_AGOTADA;
+
+        GeneradorAleatorio rng(semilla, FLUJO_SOLUCIONADOR);
+        for (int n = 0; n < MAX_INTENTOS; ++n)
+        {
+            if (cancelar)
+                return SOLUCION_CANCELADA;
+            TramoTraza tramo("intento");
+            contar(CONT_INTENTOS);
+            int idx = candidatas[rng.acotado(candidatas.size())];
+            TableroCow prueba = tablero;
+            prueba.poner(idx, prueba[idx] | BANDERA_CRISTAL);
+            TableroCancelable cancelable{prueba, cancelar};
+            int r, c;
+            celdaDeIndice(idx, rows, cols, r, c);
+            propagarReflejos<Topo>(cancelable, r, c, rows, cols);
+            int distancia = distanciaAlcanzada<Topo>(prueba, idx, exitIndex, rows, cols, cancelar);
+            if (distancia < 0 || cancelar)
+                return SOLUCION_CANCELADA;
+
+            uint64_t candidato = uint64_t(distancia) << 32 | uint32_t(idx);
+            if (candidato >> 32 < mejor.load(std::memory_order_relaxed) >> 32)
+                mejor.store(candidato, std::memory_order_release);
+            intentos.fetch_add(1, std::memory_order_release);
+            if (distancia == 0)
+                return SOLUCION_ENCONTRADA;
+        }
+        return SOLUCION_AGOTADA;
+    }
+};
+
+// Diario de partida (.ccj): basta para repetir una sesión exacta. Empieza con
+// la disposición, el límite del historial de deshacer (decide hasta dónde se
+// puede deshacer) y el tablero inicial comprimido (que ya lleva la semilla y
+// el estado del generador), y sigue con un evento por acción del jugador:
+//   {varint ms desde el evento anterior, tipo, datos}
+// Pulsar guarda la celda en orden de filas y Tablero el mapa comprimido que
+// resultó de cargar o importar, para no depender de archivos externos.
+// Solucion guarda la celda que eligió el solucionador en segundo plano: cuándo
+// termina (o si se cancela) depende del reloj, así que se anota su resultado.
+const char MAGIA_DIARIO[4] = {'C', 'C', 'J', 'R'};
+const uint32_t VERSION_DIARIO = 4;
+
+enum class TipoEvento : uint8_t
+{
+    Pulsar,
+    Resolver,
+    Limpiar,
+    Exportar,
+    Tablero,
+    Deshacer,
+    Rehacer,
+    Solucion
+};
+
+const char *const NOMBRES_EVENTOS[] = {"pulsar",  "resolver", "limpiar", "exportar",
+                                       "tablero", "deshacer", "rehacer", "solucion"};
+
+struct EventoDiario
+{
+    uint64_t ms = 0;
+    TipoEvento tipo = TipoEvento::Pulsar;
+    uint64_t celda = 0;
+    std::vector<uint8_t> tablero;
+};
+
+void escribirEvento(std::vector<uint8_t> &out, const EventoDiario &ev, uint64_t msAnterior)
+{
+    escribirVarint(out, ev.ms - msAnterior);
+    out.push_back(uint8_t(ev.tipo));
+    if (ev.tipo == TipoEvento::Pulsar || ev.tipo == TipoEvento::Solucion)
+        escribirVarint(out, ev.celda);
+    else if (ev.tipo == TipoEvento::Tablero)
+    {
+        escribirVarint(out, ev.tablero.size());
+        out.insert(out.end(), ev.tablero.begin(), ev.tablero.end());
+    }
+}
+
+struct DiarioPartida
+{
+    std::ofstream out;
+    sf::Clock reloj;
+    uint64_t msAnterior = 0;
+    std::vector<uint8_t> buffer;
+
+    bool abrir(const std::string &ruta, const Partida &partida)
+    {
+        out.open(ruta, std::ios::binary | std::ios::trunc);
+        uint32_t version = VERSION_DIARIO;
+        buffer.assign(MAGIA_DIARIO, MAGIA_DIARIO + 4);
+        buffer.insert(buffer.end(), reinterpret_cast<const uint8_t *>(&version),
+                      reinterpret_cast<const uint8_t *>(&version) + 4);
+        buffer.push_back(uint8_t(disposicionCeldas));
+        escribirVarint(buffer, partida.registro.limiteBytes);
+        std::vector<uint8_t> inicial = comprimirTablero(partida.grid, partida.cabecera());
+        escribirVarint(buffer, inicial.size());
+        buffer.insert(buffer.end(), inicial.begin(), inicial.end());
+        volcar();
+        reloj.restart();
+        msAnterior = 0;
+        return bool(out);
+    }
+
+    void registrar(EventoDiario ev)
+    {
+        if (!out.is_open())
+            return;
+        ev.ms = std::max<uint64_t>(msAnterior, reloj.getElapsedTime().asMilliseconds());
+        escribirEvento(buffer, ev, msAnterior);
+        msAnterior = ev.ms;
+        volcar();
+    }
+
+    // Cada evento llega al disco enseguida: el diario sirve sobre todo cuando
+    // la partida acaba mal
+    void volcar()
+    {
+        out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+        out.flush();
+        buffer.clear();
+    }
+};
+
+struct LectorDiario
+{
+    ArchivoMapeado archivo;
+    const uint8_t *p = nullptr, *fin = nullptr;
+    Disposicion disposicion = Disposicion::Filas;
+    uint64_t limiteDeshacer = 0;
+    MapaBinario inicial;
+    uint64_t ms = 0;
+
+    bool abrir(const std::string &ruta)
+    {
+        if (!archivo.abrir(ruta) || archivo.tam < 9 || std::memcmp(archivo.datos, MAGIA_DIARIO, 4) != 0)
+        {
+            std::cerr << "Error: " << ruta << " no es un diario de partida" << std::endl;
+            return false;
+        }
+        uint32_t version;
+        std::memcpy(&version, archivo.datos + 4, 4);
+        if (archivo.datos[8] > uint8_t(Disposicion::Teselas))
+        {
+            std::cerr << "Error: " << ruta << " no es un diario de partida valido" << std::endl;
+            return false;
+        }
+        disposicion = Disposicion(archivo.datos[8]);
+        p = archivo.datos + 9;
+        fin = archivo.datos + archivo.tam;
+        uint64_t tam;
+        if (version != VERSION_DIARIO || !leerVarint(p, fin, limiteDeshacer) || !leerVarint(p, fin, tam) ||
+            tam > uint64_t(fin - p) ||
+            !descomprimirMapa(p, tam, inicial))
+        {
+            std::cerr << "Error: " << ruta << " no es un diario de partida valido" << std::endl;
+            return false;
+        }
+        p += tam;
+        ms = 0;
+        return true;
+    }
+
+    // Un evento cortado al final (la partida se cerró a medias) termina el diario
+    bool siguiente(EventoDiario &ev)
+    {
+        uint64_t delta;
+        if (p >= fin || !leerVarint(p, fin, delta) || p >= fin)
+            return false;
+        ev.ms = ms += delta;
+        ev.tipo = TipoEvento(*p++);
+        if (ev.tipo == TipoEvento::Pulsar || ev.tipo == TipoEvento::Solucion)
+            return leerVarint(p, fin, ev.celda);
+        if (ev.tipo == TipoEvento::Tablero)
+        {
+            uint64_t tam;
+            if (!leerVarint(p, fin, tam) || tam > uint64_t(fin - p))
+                return false;
+            ev.tablero.assign(p, p + tam);
+            p += tam;
+        }
+        return ev.tipo <= TipoEvento::Solucion;
+    }
+};
+
+// Aplica un evento del diario; Exportar lo resuelve quien llama porque depende
+// de si hay ventana
+void aplicarEvento(Partida &partida, const EventoDiario &ev, const std::vector<int> *cascada = nullptr)
+{
+    if (ev.tipo == TipoEvento::Deshacer)
+    {
+        partida.deshacer();
+        return;
+    }
+    if (ev.tipo == TipoEvento::Rehacer)
+    {
+        partida.rehacer();
+        return;
+    }
+    partida.iniciarAccion();
+    switch (ev.tipo)
+    {
+    case TipoEvento::Pulsar:
+        if (ev.celda < uint64_t(partida.rows) * partida.cols)
+            partida.pulsarCelda(indiceCelda(int(ev.celda / partida.cols), int(ev.celda % partida.cols),
+                                            partida.rows, partida.cols),
+                                cascada);
+        break;
+    case TipoEvento::Resolver:
+        partida.resolver();
+        break;
+    case TipoEvento::Solucion:
+        if (ev.celda < uint64_t(partida.rows) * partida.cols)
+            partida.aplicarSolucion(indiceCelda(int(ev.celda / partida.cols), int(ev.celda % partida.cols),
+                                                partida.rows, partida.cols));
+        break;
+    case TipoEvento::Limpiar:
+        partida.limpiar();
+        break;
+    case TipoEvento::Tablero:
+    {
+        MapaBinario mapa;
+        if (descomprimirMapa(ev.tablero.data(), ev.tablero.size(), mapa) &&
+            (int)mapa.cabecera->rows == partida.rows && (int)mapa.cabecera->cols == partida.cols)
+        {
+            partida.cargar(mapa);
+            partida.actualizarCamino();
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    partida.cerrarAccion();
+}
+
+// Reloj de la simulación a paso fijo, independiente del ritmo de dibujo: cada
+// frame pregunta cuántos ticks de 1/hz tocan por el tiempo real transcurrido.
+// Con hz = 0 hay un tick por frame y la simulación va tan rápido como el
+// bucle. Si un frame muy lento acumula más de MAX_TICKS_FRAME, el resto se
+// pierde: la simulación se retrasa en lugar de entrar en espiral.
+struct PasoFijo
+{
+    static const int MAX_TICKS_FRAME = 8;
+
+    double hz;
+    double acumuladoMs = 0;
+    double msSimulados = 0;
+    uint64_t ticks = 0, perdidos = 0;
+    sf::Clock reloj;
+
+    explicit PasoFijo(double h) : hz(h) {}
+
+    double msPorTick() const
+    {
+        return hz > 0 ? 1000 / hz : 0;
+    }
+
+    int avanzar()
+    {
+        double ms = reloj.restart().asMicroseconds() / 1000.0;
+        if (hz <= 0)
+        {
+            msSimulados += ms;
+            return 1;
+        }
+        acumuladoMs += ms;
+        int n = int(acumuladoMs / msPorTick());
+        if (n > MAX_TICKS_FRAME)
+        {
+            perdidos += n - MAX_TICKS_FRAME;
+            n = MAX_TICKS_FRAME;
+            acumuladoMs = 0;
+        }
+        else
+        {
+            acumuladoMs -= n * msPorTick();
+        }
+        return n;
+    }
+
+    // Tras una espera en reposo no se recupera el tiempo parado (no había
+    // nada que simular) y el primer tick va enseguida, para que la entrada que
+    // despertó al bucle no espere al siguiente
+    void reanudar()
+    {
+        reloj.restart();
+        acumuladoMs = msPorTick();
+    }
+
+    void tick()
+    {
+        ++ticks;
+        msSimulados += msPorTick();
+    }
+};
+
+// Orden del jugador a la espera del siguiente tick. Las que cambian la
+// partida son eventos del diario; guardar, archivar, importar y cargar también
+// esperan su turno para ver el tablero con las anteriores ya aplicadas.
+struct Comando
+{
+    enum Tipo
+    {
+        Evento,
+        Guardar,
+        GuardarComprimido,
+        Archivar,
+        Importar,
+        Cargar
+    };
+    Tipo tipo = Evento;
+    EventoDiario ev;
+    std::chrono::steady_clock::time_point entrada;
+};
+
+// Contadores por turno en CSV: una fila por evento del diario con el trabajo
+// que hizo el motor desde la fila anterior (incluye lo de los hilos de fondo)
+struct VolcadoContadores
+{
+    std::ofstream out;
+    ContadoresMotor anteriores;
+    uint64_t fila = 0;
+
+    bool abrir(const std::string &ruta)
+    {
+        out.open(ruta);
+        if (!out)
+            return false;
+        out << "fila,evento,turno,ms";
+        for (const char *nombre : NOMBRES_CONTADORES)
+            out << ',' << nombre;
+        out << '\n';
+        anteriores = leerContadores();
+        return true;
+    }
+
+    void anotar(TipoEvento tipo, int turno, float ms)
+    {
+        if (!out.is_open())
+            return;
+        ContadoresMotor ahora = leerContadores(), delta = ahora - anteriores;
+        anteriores = ahora;
+        out << fila++ << ',' << NOMBRES_EVENTOS[int(tipo)] << ',' << turno << ',' << ms;
+        for (uint64_t v : delta.valor)
+            out << ',' << v;
+        out << '\n';
+    }
+};
+
+// Destino de las exportaciones que solo se miden
+#ifdef _WIN32
+const char *const RUTA_NULA = "NUL";
+#else
+const char *const RUTA_NULA = "/dev/null";
+#endif
+
+// Repite un diario sin ventana tan rápido como se pueda y mide cada evento.
+// Las exportaciones se escriben en rutaExportar; vacía, van a RUTA_NULA
+// (cuestan lo mismo sin pisar el estado_mapa.txt del jugador).
+// Los eventos se reparten en los mismos ticks que en la ventana, pero los
+// ticks corren seguidos; con hz = 0 cada evento es un tick. Sin frames, el
+// presupuesto se aplica al p99 de los ticks que tuvieron trabajo, y su
+// histograma es lo que se escribe en el resumen.
+int repetirDiario(const std::string &ruta, const std::string &rutaExportar, const std::string &rutaContadores,
+                  double hz, float presupuestoMs, const std::string &rutaResumen)
+{
+    LectorDiario lector;
+    if (!lector.abrir(ruta))
+        return 1;
+    disposicionCeldas = lector.disposicion;
+    const CabeceraMapa &cab = *lector.inicial.cabecera;
+    Partida partida(cab.rows, cab.cols, cab.semilla);
+    partida.registro.limiteBytes = lector.limiteDeshacer;
+    partida.cargar(lector.inicial);
+    VolcadoContadores volcado;
+    if (!rutaContadores.empty() && !volcado.abrir(rutaContadores))
+        std::cerr << "Error: No se pudo crear " << rutaContadores << std::endl;
+
+    EventoDiario ev;
+    int eventos = 0;
+    float msPeor = 0;
+    EventoDiario peor;
+    uint64_t msUltimo = 0; // un evento cortado al final ya suma su delta a ev.ms
+    PasoFijo paso(hz);
+    HistogramaTiempos tiempoTick;
+    sf::Clock total, reloj, relojTick;
+    bool hayEvento = lector.siguiente(ev);
+    while (hayEvento)
+    {
+        paso.tick();
+        if (hz <= 0)
+            paso.msSimulados = double(ev.ms);
+        if (ev.ms > paso.msSimulados)
+            continue;
+        relojTick.restart();
+        while (hayEvento && ev.ms <= paso.msSimulados)
+        {
+            reloj.restart();
+            if (ev.tipo == TipoEvento::Exportar)
+                escribirCodigos(rutaExportar.empty() ? RUTA_NULA : rutaExportar,
+                                capturarCodigos(partida.grid, partida.cols), partida.rows, partida.cols);
+            else
+                aplicarEvento(partida, ev);
+            float ms = reloj.getElapsedTime().asSeconds() * 1000;
+            volcado.anotar(ev.tipo, partida.turnCounter, ms);
+            if (ms >= msPeor)
+            {
+                msPeor = ms;
+                peor.tipo = ev.tipo;
+                peor.ms = ev.ms;
+            }
+            ++eventos;
+            msUltimo = ev.ms;
+            hayEvento = lector.siguiente(ev);
+        }
+        tiempoTick.anotar(uint64_t(relojTick.getElapsedTime().asMicroseconds()));
+    }
+    float msTotal = total.getElapsedTime().asSeconds() * 1000;
+    std::cout << eventos << " eventos de " << msUltimo / 1000.0 << " s de partida en " << msTotal << " ms" << std::endl;
+    if (paso.ticks > 0)
+        std::cout << paso.ticks << " ticks de simulacion (" << paso.ticks / std::max(msTotal / 1000, 1e-6f)
+                  << " ticks/s)" << std::endl;
+    if (eventos > 0)
+        std::cout << "evento mas lento: " << NOMBRES_EVENTOS[int(peor.tipo)] << " a los " << peor.ms << " ms (" << msPeor
+                  << " ms)" << std::endl;
+    if (trazaActiva && registroTrazas.volcar("trace.json"))
+        std::cout << "Traza volcada en trace.json" << std::endl;
+    std::ofstream resumen(rutaResumen);
+    if (resumen)
+    {
+        resumen << "# tiempo de tick\n";
+        tiempoTick.escribir(resumen);
+    }
+    std::cout << "Tiempo de tick: " << tiempoTick.resumen() << std::endl;
+    std::cout << "Huella final: " << partida.huella() << std::endl;
+    if (presupuestoMs > 0 && tiempoTick.percentil(99) > presupuestoMs)
+    {
+        std::cerr << "Presupuesto superado: p99 " << tiempoTick.percentil(99) << " ms > " << presupuestoMs
+                  << " ms" << std::endl;
+        return 2;
+    }
+    return 0;
+}
+
+// Compara propagación y BFS sobre un tablero grande con cada disposición
+int ejecutarBenchmark(int rows, int cols)
+{
+    for (Disposicion d : {Disposicion::Filas, Disposicion::Teselas})
+    {
+        disposicionCeldas = d;
+        GeneradorAleatorio rng(1);
+        std::vector<TriCell> grid = crearGrid(rows, cols);
+
+        // Mismas semillas (en fila/columna) para ambas disposiciones
+        std::vector<std::pair<int, int>> semillas;
+        for (int i = 0; i < rows * cols / 50; ++i)
+            semillas.push_back({(int)rng.acotado(rows), (int)rng.acotado(cols)});
+
+        sf::Clock reloj;
+        for (auto [r, c] : semillas)
+        {
+            TriCell &cell = grid[indiceCelda(r, c, rows, cols)];
+            if (cell.isCrystal)
+                continue;
+            cell.isCrystal = true;
+            propagateReflection(grid, r, c, rows, cols);
+        }
+        float msPropagacion = reloj.restart().asSeconds() * 1000;
+        int crystalCount = 0;
+        for (const auto &c : grid)
+        {
+            if (c.isCrystal)
+                crystalCount++;
+        }
+
+        // Tablero lleno: el BFS recorre todas las celdas desde una esquina
+        // hasta la salida en la opuesta
+        for (auto &cell : grid)
+        {
+            cell.isCrystal = true;
+            cell.isReflected = true;
+        }
+        TriCell &inicio = grid[indiceCelda(0, 0, rows, cols)];
+        inicio.isCrystal = true;
+        inicio.isReflected = false;
+        int exitIndex = indiceCelda(rows - 1, cols - 1, rows, cols);
+        grid[exitIndex].isExit = true;
+
+        reloj.restart();
+        const int repeticiones = 5;
+        for (int i = 0; i < repeticiones; ++i)
+            buscarCaminoBFS(grid, exitIndex, rows, cols);
+        float msBFS = reloj.restart().asSeconds() * 1000 / repeticiones;
+
+        std::cout << (d == Disposicion::Filas ? "filas  " : "teselas")
+                  << "  " << rows << "x" << cols
+                  << "  propagacion: " << msPropagacion << " ms"
+                  << "  bfs: " << msBFS << " ms"
+                  << "  cristales: " << crystalCount << std::endl;
+    }
+    return 0;
+}
+
+// Mide tamaño y velocidad de la codificación comprimida frente al texto y al
+// binario crudo, sobre un estado_mapa.txt o sobre un tablero generado
+int ejecutarBenchmarkCompresion(const std::string &rutaTexto)
+{
+    // Se trabaja sobre los códigos de texto para no crear TriCell: un tablero
+    // importado de decenas de millones de celdas no cabría en memoria
+    MapaTexto mapa;
+    if (rutaTexto.empty() || !importarEstadoMapa(rutaTexto, mapa))
+    {
+        // Mayoría de celdas vacías con tramos de reflejos y algún bloqueo
+        mapa.rows = mapa.cols = 2048;
+        mapa.exitRow = mapa.exitCol = 0;
+        mapa.celdas.assign(size_t(mapa.rows) * mapa.cols, '.');
+        GeneradorAleatorio rng(1);
+        for (int i = 0; i < mapa.rows * mapa.cols / 4000; ++i)
+        {
+            int r = rng.acotado(mapa.rows), c = rng.acotado(mapa.cols);
+            int largo = 1 + rng.acotado(200);
+            for (int k = 0; k < largo && c + k < mapa.cols; ++k)
+                mapa.celdas[size_t(r) * mapa.cols + c + k] = k < 2 ? 'M' : 'R';
+        }
+        for (int i = 0; i < mapa.rows * mapa.cols / 1000; ++i)
+        {
+            char &ch = mapa.celdas[rng.acotado(mapa.celdas.size())];
+            if (ch == '.')
+                ch = 'X';
+        }
+        mapa.celdas[0] = 'S';
+    }
+    int rows = mapa.rows, cols = mapa.cols;
+
+    TriCell salida(0, 0, true, mapa.exitRow, mapa.exitCol);
+    CabeceraMapa cabecera = crearCabecera(rows, cols, salida, 0, 0, GeneradorAleatorio());
+    uint64_t palabras = palabrasPorPlano(rows, cols);
+    std::vector<uint64_t> planos(NUM_PLANOS * palabras, 0);
+    for (uint64_t bit = 0; bit < mapa.celdas.size(); ++bit)
+    {
+        char ch = mapa.celdas[bit];
+        uint64_t mascara = 1ULL << (bit % 64);
+        if (ch == 'M' || ch == 'R' || ch == 'P')
+            planos[PLANO_CRISTAL * palabras + bit / 64] |= mascara;
+        if (ch == 'R' || ch == 'P')
+            planos[PLANO_REFLEJO * palabras + bit / 64] |= mascara;
+        if (ch == 'X')
+            planos[PLANO_BLOQUEO * palabras + bit / 64] |= mascara;
+    }
+
+    const int repeticiones = 10;
+    sf::Clock reloj;
+    std::vector<uint8_t> comprimido;
+    for (int i = 0; i < repeticiones; ++i)
+        comprimido = comprimirMapa(cabecera, planos.data());
+    float msComprimir = reloj.restart().asSeconds() * 1000 / repeticiones;
+
+    MapaBinario mapaLeido;
+    for (int i = 0; i < repeticiones; ++i)
+        descomprimirMapa(comprimido.data(), comprimido.size(), mapaLeido);
+    float msDescomprimir = reloj.restart().asSeconds() * 1000 / repeticiones;
+
+    bool iguales = mapaLeido.planosPropios == planos;
+    double crudo = sizeof(CabeceraMapa) + planos.size() * 8.0;
+    double texto = double(rows) * (2 * cols + 1);
+    double mb = crudo / (1 << 20);
+    std::cout << rows << "x" << cols
+              << "  texto: " << texto / 1024 << " KB"
+              << "  binario: " << crudo / 1024 << " KB"
+              << "  comprimido: " << comprimido.size() / 1024.0 << " KB"
+              << " (" << crudo / comprimido.size() << "x)" << std::endl
+              << "comprimir: " << msComprimir << " ms (" << mb / msComprimir * 1000 << " MB/s)"
+              << "  descomprimir: " << msDescomprimir << " ms (" << mb / msDescomprimir * 1000 << " MB/s)"
+              << (iguales ? "" : "  ERROR: los planos no coinciden") << std::endl;
+    return iguales ? 0 : 1;
+}
+
+// Análisis masivo de un archivo de mapas: cada hilo recorre su rango de ids
+// sobre la misma proyección y acumula sus propios totales
+struct TrabajadorAnalisis
+{
+    const ArchivoMapas *archivo = nullptr;
+    uint64_t desde = 0, hasta = 0;
+    uint64_t mapas = 0, celdas = 0, cristales = 0, reflejos = 0, bloqueos = 0;
+    sf::Thread hilo;
+
+    TrabajadorAnalisis() : hilo(&TrabajadorAnalisis::ejecutar, this) {}
+
+    void ejecutar()
+    {
+        MapaBinario mapa;
+        uint64_t id;
+        RecorridoArchivo recorrido(*archivo, desde, hasta);
+        while (recorrido.siguiente(mapa, id))
+        {
+            uint64_t palabras = palabrasPorPlano(mapa.cabecera->rows, mapa.cabecera->cols);
+            for (uint64_t w = 0; w < palabras; ++w)
+            {
+                cristales += __builtin_popcountll(mapa.planos[PLANO_CRISTAL][w]);
+                reflejos += __builtin_popcountll(mapa.planos[PLANO_REFLEJO][w]);
+                bloqueos += __builtin_popcountll(mapa.planos[PLANO_BLOQUEO][w]);
+            }
+            celdas += uint64_t(mapa.cabecera->rows) * mapa.cabecera->cols;
+            ++mapas;
+        }
+    }
+};
+
+int ejecutarAnalisisArchivo(const std::string &ruta, int numHilos)
+{
+    ArchivoMapas archivo;
+    if (!archivo.abrir(ruta))
+    {
+        std::cerr << "Error: No se pudo abrir el archivo de mapas " << ruta << std::endl;
+        return 1;
+    }
+    numHilos = std::max(1, numHilos);
+    sf::Clock reloj;
+    std::vector<TrabajadorAnalisis> trabajadores(numHilos);
+    for (int i = 0; i < numHilos; ++i)
+    {
+        trabajadores[i].archivo = &archivo;
+        trabajadores[i].desde = archivo.numMapas * i / numHilos;
+        trabajadores[i].hasta = archivo.numMapas * (i + 1) / numHilos;
+        trabajadores[i].hilo.launch();
+    }
+    TrabajadorAnalisis total;
+    for (auto &t : trabajadores)
+    {
+        t.hilo.wait();
+        total.mapas += t.mapas;
+        total.celdas += t.celdas;
+        total.cristales += t.cristales;
+        total.reflejos += t.reflejos;
+        total.bloqueos += t.bloqueos;
+    }
+    float ms = reloj.getElapsedTime().asSeconds() * 1000;
+
+    double celdas = std::max<uint64_t>(1, total.celdas);
+    std::cout << total.mapas << " de " << archivo.numMapas << " mapas, "
+              << archivo.archivo.tam / 1024.0 << " KB, " << numHilos << " hilos" << std::endl
+              << "cristales: " << 100 * total.cristales / celdas << "%"
+              << "  reflejos: " << 100 * total.reflejos / celdas << "%"
+              << "  bloqueadas: " << 100 * total.bloqueos / celdas << "%" << std::endl
+              << ms << " ms (" << total.mapas / std::max(ms, 0.001f) * 1000 << " mapas/s)" << std::endl;
+    return total.mapas == archivo.numMapas ? 0 : 1;
+}
+
+// Panel lateral con sus textos. Solo se recompone cuando cambia algún texto:
+// entonces fondo y textos se pintan en una textura y, cada frame, el panel
+// entero es un único sprite (una llamada de dibujo, sin volver a maquetar
+// glifos). Si el driver no permite render a textura, se dibuja texto a texto.
+struct PanelHud
+{
+    sf::RectangleShape fondo;
+    std::vector<const sf::Text *> textos;
+    sf::RenderTexture lienzo;
+    sf::Sprite sprite;
+    bool enTextura = false;
+    bool sucio = true;
+
+    PanelHud(float x, float ancho, float alto)
+    {
+        fondo.setSize(sf::Vector2f(ancho, alto));
+        fondo.setPosition(x, 0);
+        fondo.setFillColor(sf::Color(30, 30, 30, 220));
+        enTextura = lienzo.create(unsigned(ancho), unsigned(alto));
+        if (enTextura)
+        {
+            // Misma vista que la ventana en esa franja: los textos no se mueven
+            lienzo.setView(sf::View(sf::FloatRect(x, 0, ancho, alto)));
+            sprite.setTexture(lienzo.getTexture());
+            sprite.setPosition(x, 0);
+        }
+    }
+
+    // Solo cambia la geometría del texto si el contenido es otro
+    void poner(sf::Text &texto, const sf::String &contenido)
+    {
+        if (texto.getString() != contenido)
+        {
+            texto.setString(contenido);
+            sucio = true;
+        }
+    }
+
+    void cambiar(size_t i, const sf::Text *texto)
+    {
+        if (textos[i] != texto)
+        {
+            textos[i] = texto;
+            sucio = true;
+        }
+    }
+
+    // Para no construir el texto cuando no cambió el valor que muestra
+    static bool cambia(uint64_t &anterior, uint64_t valor)
+    {
+        bool distinto = anterior != valor;
+        anterior = valor;
+        return distinto;
+    }
+
+    void dibujar(sf::RenderTarget &destino)
+    {
+        if (!enTextura)
+        {
+            destino.draw(fondo);
+            for (const sf::Text *t : textos)
+                destino.draw(*t);
+            return;
+        }
+        if (sucio)
+        {
+            lienzo.clear(sf::Color::Transparent);
+            lienzo.draw(fondo);
+            for (const sf::Text *t : textos)
+                lienzo.draw(*t);
+            lienzo.display();
+            sucio = false;
+        }
+        destino.draw(sprite);
+    }
+};
+
+// Capa estática del tablero: fondo, contornos, bloqueos y salida, que solo
+// cambian en los eventos de turno. Se rasteriza una vez en una textura
+// partida en teselas de TAM_TESELA_CAPA píxeles y, cada frame, solo se
+// repintan las teselas donde cambió el color base de alguna celda. La misma
+// pasada deja en "estados" un código por celda visible (banderas, camino,
+// hover y vista previa) con el que PreparadorVertices pinta la capa dinámica.
+const int TAM_TESELA_CAPA = 128;
+
+enum BitEstadoVisible : uint8_t
+{
+    // Los cuatro bits bajos son las BanderaCelda
+    VISIBLE_CAMINO = 16,
+    VISIBLE_HOVER = 32,
+    VISIBLE_CASCADA = 64,
+    VISIBLE_PREVISTO = 128
+};
+
+sf::Color colorBase(uint8_t estado)
+{
+    return (estado & BANDERA_BLOQUEO) ? sf::Color(50, 50, 50)
+           : (estado & BANDERA_SALIDA) ? sf::Color::Red
+                                       : sf::Color::White;
+}
+
+// Las mismas reglas que updateHover y la vista previa; transparente si el
+// color es el de la capa estática
+sf::Color colorDinamico(uint8_t estado)
+{
+    sf::Color color;
+    if (estado & VISIBLE_HOVER)
+        color = sf::Color::Yellow;
+    else if (estado & VISIBLE_CAMINO)
+        color = sf::Color::Green;
+    else if (estado & (BANDERA_BLOQUEO | BANDERA_SALIDA))
+        color = colorBase(estado);
+    else if ((estado & BANDERA_CRISTAL) && (estado & BANDERA_REFLEJO))
+        color = sf::Color(150, 255, 255);
+    else if (estado & BANDERA_CRISTAL)
+        color = sf::Color::Cyan;
+    else
+        color = sf::Color::White;
+    if (estado & VISIBLE_CASCADA)
+        color = sf::Color(205, 240, 240);
+    if ((estado & VISIBLE_PREVISTO) && !(estado & (BANDERA_SALIDA | VISIBLE_HOVER)))
+        color = sf::Color(190, 240, 190);
+    return color == colorBase(estado) ? sf::Color::Transparent : color;
+}
+
+struct CapaEstatica
+{
+    int ancho, alto, teselasX, teselasY;
+    int rows = 0, cols = 0, filasVisibles = 0, colsVisibles = 0;
+    sf::RenderTexture lienzo;
+    sf::Sprite sprite;
+    bool enTextura = false;
+    std::vector<uint8_t> estados;      // por celda visible, en orden de filas
+    std::vector<uint8_t> baseDibujada; // color base pintado en la textura
+    std::vector<bool> teselaSucia;
+    sf::ConvexShape forma;
+
+    CapaEstatica(int w, int h)
+        : ancho(w), alto(h), teselasX((w + TAM_TESELA_CAPA - 1) / TAM_TESELA_CAPA),
+          teselasY((h + TAM_TESELA_CAPA - 1) / TAM_TESELA_CAPA)
+    {
+        enTextura = lienzo.create(w, h);
+        if (enTextura)
+        {
+            lienzo.clear(sf::Color::Black);
+            sprite.setTexture(lienzo.getTexture());
+        }
+        forma.setPointCount(3);
+        forma.setOutlineThickness(1);
+        forma.setOutlineColor(sf::Color::Black);
+    }
+
+    static uint8_t estadoDe(const TriCell &cell)
+    {
+        return banderasDe(cell) | (cell.isPath ? VISIBLE_CAMINO : 0) | (cell.isHovered ? VISIBLE_HOVER : 0);
+    }
+
+    // Solo bloqueo y salida deciden el color base
+    static uint8_t baseDe(uint8_t estado)
+    {
+        return estado & (BANDERA_BLOQUEO | BANDERA_SALIDA);
+    }
+
+    int indiceVisible(const TriCell &cell) const
+    {
+        if (cell.row >= filasVisibles || cell.col >= colsVisibles)
+            return -1;
+        return cell.row * colsVisibles + cell.col;
+    }
+
+    // Rango de filas/columnas cuyos triángulos (y contornos) tocan [desde, hasta) en píxeles
+    static void celdasQueTocan(int desde, int hasta, int limite, int &primera, int &ultima)
+    {
+        primera = std::max(0, (desde - TRI_SIZE - 1) / (TRI_SIZE / 2));
+        ultima = std::min(limite - 1, (hasta + 1) / (TRI_SIZE / 2));
+    }
+
+    void marcarCelda(int r, int c)
+    {
+        int x = c * (TRI_SIZE / 2), y = r * (TRI_SIZE / 2);
+        for (int ty = std::max(0, (y - 1) / TAM_TESELA_CAPA);
+             ty <= std::min(teselasY - 1, (y + TRI_SIZE + 1) / TAM_TESELA_CAPA); ++ty)
+            for (int tx = std::max(0, (x - 1) / TAM_TESELA_CAPA);
+                 tx <= std::min(teselasX - 1, (x + TRI_SIZE + 1) / TAM_TESELA_CAPA); ++tx)
+                teselaSucia[ty * teselasX + tx] = true;
+    }
+
+    void pintarTesela(const std::vector<TriCell> &grid, int tx, int ty)
+    {
+        int x0 = tx * TAM_TESELA_CAPA, y0 = ty * TAM_TESELA_CAPA;
+        // Los triángulos del borde se salen de la tesela (las filas se solapan
+        // media altura): la vista recorta el dibujo a su rectángulo para no
+        // pisar los píxeles de las vecinas, que no se repintan
+        float w = float(std::min(TAM_TESELA_CAPA, ancho - x0)), h = float(std::min(TAM_TESELA_CAPA, alto - y0));
+        sf::View vista(sf::FloatRect(float(x0), float(y0), w, h));
+        vista.setViewport(sf::FloatRect(float(x0) / ancho, float(y0) / alto, w / ancho, h / alto));
+        lienzo.setView(vista);
+        sf::RectangleShape borrado(sf::Vector2f(TAM_TESELA_CAPA, TAM_TESELA_CAPA));
+        borrado.setPosition(x0, y0);
+        borrado.setFillColor(sf::Color::Black);
+        lienzo.draw(borrado, sf::BlendNone);
+        int r0, r1, c0, c1;
+        celdasQueTocan(y0, y0 + TAM_TESELA_CAPA, filasVisibles, r0, r1);
+        celdasQueTocan(x0, x0 + TAM_TESELA_CAPA, colsVisibles, c0, c1);
+        for (int r = r0; r <= r1; ++r)
+        {
+            for (int c = c0; c <= c1; ++c)
+            {
+                const TriCell &cell = grid[indiceCelda(r, c, rows, cols)];
+                for (int k = 0; k < 3; ++k)
+                    forma.setPoint(k, cell.triangle.getPoint(k));
+                forma.setFillColor(colorBase(baseDibujada[r * colsVisibles + c]));
+                lienzo.draw(forma);
+            }
+        }
+    }
+
+    // Devuelve true si cambió el tamaño del tablero
+    bool actualizar(const std::vector<TriCell> &grid, int r, int c)
+    {
+        bool nuevo = r != rows || c != cols;
+        if (nuevo)
+        {
+            rows = r;
+            cols = c;
+            filasVisibles = std::min(rows, alto / (TRI_SIZE / 2) + 1);
+            colsVisibles = std::min(cols, ancho / (TRI_SIZE / 2) + 1);
+            estados.assign(filasVisibles * colsVisibles, 0);
+            baseDibujada.assign(filasVisibles * colsVisibles, 0xFF);
+            teselaSucia.assign(teselasX * teselasY, true);
+        }
+        if (!enTextura)
+            return nuevo;
+
+        // Una pasada: estados visibles y teselas con algún cambio de color base
+        for (int fila = 0; fila < filasVisibles; ++fila)
+        {
+            for (int col = 0; col < colsVisibles; ++col)
+            {
+                int v = fila * colsVisibles + col;
+                estados[v] = estadoDe(grid[indiceCelda(fila, col, rows, cols)]);
+                if (baseDe(estados[v]) != baseDibujada[v])
+                {
+                    baseDibujada[v] = baseDe(estados[v]);
+                    marcarCelda(fila, col);
+                }
+            }
+        }
+        bool repintada = false;
+        for (int t = 0; t < teselasX * teselasY; ++t)
+        {
+            if (teselaSucia[t])
+            {
+                pintarTesela(grid, t % teselasX, t / teselasX);
+                teselaSucia[t] = false;
+                repintada = true;
+            }
+        }
+        if (repintada)
+            lienzo.display();
+        return nuevo;
+    }
+
+    void marcarPrevista(const std::vector<TriCell> &grid, const Prediccion &prediccion)
+    {
+        for (int idx : prediccion.cascada)
+        {
+            int v = indiceVisible(grid[idx]);
+            if (v != -1)
+                estados[v] |= VISIBLE_CASCADA;
+        }
+        for (int idx : prediccion.camino)
+        {
+            int v = indiceVisible(grid[idx]);
+            if (v != -1)
+                estados[v] |= VISIBLE_PREVISTO;
+        }
+    }
 
-        for (auto [dr, dc] : directions)
+    void dibujar(sf::RenderTarget &destino, const std::vector<TriCell> &grid)
+    {
+        if (!enTextura)
         {
-            int neighborIdx = getIndex(r + dr, c + dc);
-            int reflectIdx = getIndex(r - dr, c - dc);
-            if (neighborIdx != -1 && reflectIdx != -1)
-            {
-                if (grid[neighborIdx].isCrystal && !grid[reflectIdx].isCrystal && !grid[reflectIdx].isExit && !grid[reflectIdx].isBlocked)
-                {
-                    grid[reflectIdx].isCrystal = true;
-                    grid[reflectIdx].isReflected = true;
-                    grid[reflectIdx].triangle.setFillColor(sf::Color(150, 255, 255));
-                    queue.push({r - dr, c - dc});
-                }
-            }
+            for (const auto &cell : grid)
+                destino.draw(cell.triangle);
+            return;
         }
+        destino.draw(sprite);
     }
-}
+};
 
-void buscarCaminoBFS(std::vector<TriCell> &grid, int exitIndex, int rows, int cols)
+// Capa dinámica: un triángulo por celda visible, transparente si su color es
+// el de la capa estática. Como en el ejemplo island de SFML, los vértices los
+// prepara un hilo de trabajo: recibe los estados del frame, recolorea en su
+// búfer ("atras") solo las celdas que cambiaron y anota esos rangos. El hilo
+// principal nunca lo espera: si sigue ocupado se dibuja lo último subido;
+// cuando termina, se suben a la GPU (o a la copia "delante" si no hay
+// VertexBuffer) solo los rangos sucios y se le pasa el siguiente frame.
+struct PreparadorVertices
 {
-    auto getIndex = [&](int r, int c) -> int
+    // Mientras enCurso, solo el hilo toca estos campos
+    std::vector<uint8_t> estados;
+    std::vector<uint8_t> hechos; // estados ya volcados en "atras"
+    std::vector<sf::Vertex> atras;
+    std::vector<std::pair<size_t, size_t>> sucios;
+    std::atomic<bool> enCurso{false};
+    bool terminado = false;
+    sf::Thread hilo;
+
+    std::vector<sf::Vertex> delante;
+    sf::VertexBuffer gpu;
+    bool enGpu = false;
+
+    PreparadorVertices() : hilo(&PreparadorVertices::ejecutar, this), gpu(sf::Triangles, sf::VertexBuffer::Stream) {}
+
+    void ejecutar()
     {
-        if (r < 0 || r >= rows || c < 0 || c >= cols)
-            return -1;
-        return r * cols + c;
-    };
-    for (auto &cell : grid)
-        cell.isPath = false;
-    std::queue<int> q;
-    std::unordered_map<int, int> parent;
-    int start = -1, end = exitIndex;
+        TramoTraza tramo("preparar vertices");
+        sucios.clear();
+        for (size_t i = 0; i < estados.size(); ++i)
+        {
+            if (estados[i] == hechos[i])
+                continue;
+            hechos[i] = estados[i];
+            sf::Color color = colorDinamico(estados[i]);
+            for (int k = 0; k < 3; ++k)
+                atras[3 * i + k].color = color;
+            if (!sucios.empty() && sucios.back().second == 3 * i)
+                sucios.back().second += 3;
+            else
+                sucios.push_back({3 * i, 3 * i + 3});
+        }
+        terminado = true;
+        enCurso = false;
+    }
 
-    for (int i = 0; i < grid.size(); ++i)
+    // Geometría de las celdas visibles; solo al cambiar de tablero (y es lo
+    // único que espera al hilo)
+    void configurar(const std::vector<TriCell> &grid, int filas, int columnas, int rows, int cols)
     {
-        if (grid[i].isCrystal && !grid[i].isReflected)
+        hilo.wait();
+        terminado = false;
+        atras.assign(size_t(filas) * columnas * 3, sf::Vertex());
+        for (int r = 0; r < filas; ++r)
         {
-            start = i;
-            break;
+            for (int c = 0; c < columnas; ++c)
+            {
+                const TriCell &cell = grid[indiceCelda(r, c, rows, cols)];
+                for (int k = 0; k < 3; ++k)
+                    atras[(size_t(r) * columnas + c) * 3 + k] =
+                        sf::Vertex(cell.triangle.getPoint(k), sf::Color::Transparent);
+            }
         }
+        hechos.assign(size_t(filas) * columnas, 0xFF);
+        estados.clear();
+        delante = atras;
+        enGpu = sf::VertexBuffer::isAvailable() && gpu.create(atras.size()) && gpu.update(atras.data());
     }
-    if (start == -1)
-        return;
-    q.push(start);
-    parent[start] = -1;
 
-    while (!q.empty())
+    // Una vez por frame con los estados visibles
+    void sincronizar(const std::vector<uint8_t> &nuevos)
     {
-        int idx = q.front();
-        q.pop();
-        int r = grid[idx].row, c = grid[idx].col;
-        if (idx == end)
-            break;
-        for (auto [dr, dc] : std::vector<std::pair<int, int>>{{0, 1}, {1, 0}, {0, -1}, {-1, 0}})
+        if (enCurso)
+            return;
+        if (terminado)
         {
-            int ni = getIndex(r + dr, c + dc);
-            if (ni != -1 && (grid[ni].isCrystal || grid[ni].isExit) && !parent.count(ni))
+            for (const auto &rango : sucios)
             {
-                q.push(ni);
-                parent[ni] = idx;
+                if (enGpu)
+                    gpu.update(atras.data() + rango.first, rango.second - rango.first, rango.first);
+                else
+                    std::copy(atras.begin() + rango.first, atras.begin() + rango.second, delante.begin() + rango.first);
             }
+            terminado = false;
+        }
+        if (nuevos != estados)
+        {
+            estados = nuevos;
+            enCurso = true;
+            hilo.launch();
         }
     }
 
-    int node = end;
-    while (parent.count(node) && parent[node] != -1)
+    void dibujar(sf::RenderTarget &destino) const
     {
-        grid[node].isPath = true;
-        node = parent[node];
+        if (enGpu)
+            destino.draw(gpu);
+        else if (!delante.empty())
+            destino.draw(delante.data(), delante.size(), sf::Triangles);
     }
-}
+};
 
-void exportarEstadoMapa(const std::vector<TriCell> &grid, int rows, int cols)
+int main(int argc, char *argv[])
 {
-    std::ofstream outFile("estado_mapa.txt");
-    if (outFile.is_open())
+    // --teselas           celdas en bloques Morton en lugar de por filas
+    // --topologia T        cuadrada (por defecto), triangulo3, triangulo12, hex
+    // --bench [filas cols] compara ambas disposiciones sin abrir ventana
+    // --bench-compresion [archivo.txt] mide la codificación comprimida
+    // --semilla N          partida reproducible (por defecto, la hora)
+    // --cargar archivo     empieza desde un mapa guardado con [G] o [Mayus+G]
+    // --cargar-de a.cca id empieza desde un mapa de un archivo de mapas
+    // --analizar-archivo a.cca [hilos] recorre todos sus mapas y resume
+    // --importar archivo   empieza desde un estado_mapa.txt
+    // --exportar-a archivo destino de [E] y origen de [I] (por defecto estado_mapa.txt)
+    // --grabar archivo     diario de la partida (por defecto diario.ccj)
+    // --repetir diario     repite una partida sin ventana, tan rápido como se pueda;
+    //                      sus exportaciones solo se guardan con --exportar-a
+    // --velocidad X        con --repetir, la muestra en la ventana a X veces su ritmo
+    // --memoria-deshacer MB límite del historial de deshacer (por defecto 64)
+    // --traza              graba la traza desde el inicio y la vuelca en trace.json
+    // --contadores f.csv   trabajo del motor por turno (también con --repetir)
+    // --resumen-frames f   histograma de tiempos de frame (de tick con --repetir sin
+    //                      ventana) al salir (por defecto frames.txt)
+    // --presupuesto MS     falla (código 2) si el p99 del frame pasa de MS; con
+    //                      --repetir sin ventana mide los ticks, y con --velocidad
+    //                      cierra la ventana al acabar el diario
+    // --reposo             sin entrada ni trabajo pendiente, espera eventos sin redibujar
+    // --fps N              límite de frames por segundo (60 por defecto con --reposo)
+    // --hz N               ticks de simulación por segundo (60 por defecto); con 0,
+    //                      uno por frame, o seguidos en --repetir sin ventana
+    uint64_t semilla = static_cast<uint64_t>(time(0));
+    std::string rutaCarga, rutaImportar, rutaExportar = "estado_mapa.txt";
+    bool exportarIndicado = false;
+    std::string rutaDiario = "diario.ccj", rutaRepetir, rutaContadores;
+    std::string rutaResumenFrames = "frames.txt";
+    float presupuestoMs = 0;
+    bool modoReposo = false;
+    int limiteFps = 0;
+    double hzSimulacion = 60;
+    float velocidad = 0;
+    size_t limiteDeshacer = 64 << 20;
+    uint64_t idCarga = 0;
+    bool cargaDeArchivo = false;
+    for (int i = 1; i < argc; ++i)
     {
-        for (int r = 0; r < rows; ++r)
+        std::string arg = argv[i];
+        if (arg == "--semilla" && i + 1 < argc)
         {
-            for (int c = 0; c < cols; ++c)
+            semilla = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--cargar" && i + 1 < argc)
+        {
+            rutaCarga = argv[++i];
+        }
+        else if (arg == "--cargar-de" && i + 2 < argc)
+        {
+            rutaCarga = argv[++i];
+            idCarga = std::strtoull(argv[++i], nullptr, 10);
+            cargaDeArchivo = true;
+        }
+        else if (arg == "--importar" && i + 1 < argc)
+        {
+            rutaImportar = argv[++i];
+        }
+        else if (arg == "--exportar-a" && i + 1 < argc)
+        {
+            rutaExportar = argv[++i];
+            exportarIndicado = true;
+        }
+        else if (arg == "--grabar" && i + 1 < argc)
+        {
+            rutaDiario = argv[++i];
+        }
+        else if (arg == "--repetir" && i + 1 < argc)
+        {
+            rutaRepetir = argv[++i];
+        }
+        else if (arg == "--velocidad" && i + 1 < argc)
+        {
+            velocidad = float(std::atof(argv[++i]));
+        }
+        else if (arg == "--memoria-deshacer" && i + 1 < argc)
+        {
+            limiteDeshacer = size_t(std::atof(argv[++i]) * (1 << 20));
+        }
+        else if (arg == "--traza")
+        {
+            trazaActiva = true;
+        }
+        else if (arg == "--contadores" && i + 1 < argc)
+        {
+            rutaContadores = argv[++i];
+        }
+        else if (arg == "--resumen-frames" && i + 1 < argc)
+        {
+            rutaResumenFrames = argv[++i];
+        }
+        else if (arg == "--presupuesto" && i + 1 < argc)
+        {
+            presupuestoMs = float(std::atof(argv[++i]));
+        }
+        else if (arg == "--reposo")
+        {
+            modoReposo = true;
+        }
+        else if (arg == "--fps" && i + 1 < argc)
+        {
+            limiteFps = std::atoi(argv[++i]);
+        }
+        else if (arg == "--hz" && i + 1 < argc)
+        {
+            hzSimulacion = std::max(0.0, std::atof(argv[++i]));
+        }
+        else if (arg == "--teselas")
+        {
+            disposicionCeldas = Disposicion::Teselas;
+        }
+        else if (arg == "--topologia" && i + 1 < argc)
+        {
+            std::string t = argv[++i];
+            if (t == "triangulo3")
+                topologiaMapa = Topologia::Triangulo3;
+            else if (t == "triangulo12")
+                topologiaMapa = Topologia::Triangulo12;
+            else if (t == "hex")
+                topologiaMapa = Topologia::Hexagonal;
+            else
+                topologiaMapa = Topologia::Cuadrada4;
+        }
+        else if (arg == "--analizar-archivo" && i + 1 < argc)
+        {
+            return ejecutarAnalisisArchivo(argv[i + 1], i + 2 < argc ? std::atoi(argv[i + 2]) : 4);
+        }
+        else if (arg == "--bench-compresion")
+        {
+            return ejecutarBenchmarkCompresion(i + 1 < argc ? argv[i + 1] : "");
+        }
+        else if (arg == "--bench")
+        {
+            int benchRows = 1024, benchCols = 1024;
+            if (i + 2 < argc)
             {
-                int idx = r * cols + c;
-                if (grid[idx].isExit)
-                    outFile << "S ";
-                else if (grid[idx].isPath)
-                    outFile << "P ";
-                else if (grid[idx].isBlocked)
-                    outFile << "X ";
-                else if (grid[idx].isCrystal && grid[idx].isReflected)
-                    outFile << "R ";
-                else if (grid[idx].isCrystal)
-                    outFile << "M ";
-                else
-                    outFile << ". ";
+                benchRows = std::atoi(argv[i + 1]);
+                benchCols = std::atoi(argv[i + 2]);
             }
-            outFile << "\n";
+            return ejecutarBenchmark(benchRows, benchCols);
         }
-        outFile.close();
     }
-}
 
-int main()
-{
-    srand(static_cast<unsigned>(time(0)));
-    sf::RenderWindow window(sf::VideoMode(WINDOW_WIDTH, WINDOW_HEIGHT), "Cuevas de Cristal");
-    std::vector<TriCell> grid;
-    const int cols = WINDOW_WIDTH / TRI_SIZE;
-    const int rows = WINDOW_HEIGHT / (TRI_SIZE / 2);
+    // La repetición visual empieza como una carga más, desde el tablero
+    // inicial del diario
+    LectorDiario repeticion;
+    bool repitiendo = !rutaRepetir.empty();
+    if (repitiendo)
+    {
+        if (velocidad <= 0)
+            return repetirDiario(rutaRepetir, exportarIndicado ? rutaExportar : "", rutaContadores, hzSimulacion, presupuestoMs,
+                                 rutaResumenFrames);
+        if (!repeticion.abrir(rutaRepetir))
+            return 1;
+        disposicionCeldas = repeticion.disposicion;
+    }
 
-    for (int row = 0; row < rows; ++row)
+    int cols = WINDOW_WIDTH / TRI_SIZE;
+    int rows = WINDOW_HEIGHT / (TRI_SIZE / 2);
+    MapaBinario mapaCargado;
+    bool cargado = repitiendo ||
+                   (!rutaCarga.empty() && (cargaDeArchivo ? cargarMapaDeArchivo(rutaCarga, idCarga, mapaCargado)
+                                                          : cargarMapaBinario(rutaCarga, mapaCargado)));
+    MapaBinario &mapaInicial = repitiendo ? repeticion.inicial : mapaCargado;
+    if (cargado)
     {
-        for (int col = 0; col < cols; ++col)
-        {
-            bool pointingUp = (row + col) % 2 == 0;
-            float x = col * (TRI_SIZE / 2);
-            float y = row * (TRI_SIZE / 2);
-            grid.emplace_back(x, y, pointingUp, row, col);
-        }
+        rows = mapaInicial.cabecera->rows;
+        cols = mapaInicial.cabecera->cols;
+        semilla = mapaInicial.cabecera->semilla;
+        topologiaMapa = Topologia(mapaInicial.cabecera->topologia);
+    }
+    MapaTexto mapaImportado;
+    bool importado = !cargado && !rutaImportar.empty() && importarEstadoMapa(rutaImportar, mapaImportado);
+    if (importado)
+    {
+        rows = mapaImportado.rows;
+        cols = mapaImportado.cols;
     }
 
-    int turnCounter = 0;
-    int turnThreshold = 10;
-    int exitIndex = rand() % grid.size();
-    grid[exitIndex].isExit = true;
-    grid[exitIndex].triangle.setFillColor(sf::Color::Red);
+    std::cout << "Semilla: " << semilla << std::endl;
+    Partida partida(rows, cols, semilla);
+    partida.registro.limiteBytes = repitiendo ? repeticion.limiteDeshacer : limiteDeshacer;
+    if (cargado)
+    {
+        partida.cargar(mapaInicial);
+        mapaCargado.archivo.cerrar();
+    }
+    else if (importado)
+    {
+        partida.importar(mapaImportado);
+        mapaImportado = MapaTexto();
+    }
+    else
+    {
+        partida.colocarSalida();
+    }
+    // Índices en su orden canónico, el mismo que obtiene la repetición al
+    // cargar el tablero inicial del diario
+    partida.indices.reconstruir(partida.grid);
+
+    DiarioPartida diario;
+    if (!repitiendo && !diario.abrir(rutaDiario, partida))
+        std::cerr << "Error: No se pudo crear el diario " << rutaDiario << std::endl;
+    VolcadoContadores volcado;
+    if (!rutaContadores.empty() && !volcado.abrir(rutaContadores))
+        std::cerr << "Error: No se pudo crear " << rutaContadores << std::endl;
+
+    std::vector<TriCell> &grid = partida.grid;
+    sf::RenderWindow window(sf::VideoMode(WINDOW_WIDTH, WINDOW_HEIGHT), "Cuevas de Cristal");
+    if (limiteFps == 0 && modoReposo)
+        limiteFps = 60;
+    if (limiteFps > 0)
+        window.setFramerateLimit(limiteFps);
 
     sf::Font font;
     if (!font.loadFromFile("arial.ttf"))
@@ -224,11 +4388,6 @@ int main()
         std::cerr << "Error: No se pudo cargar la fuente arial.ttf" << std::endl;
     }
 
-    // Fondo del panel derecho
-    sf::RectangleShape sidePanel(sf::Vector2f(200, WINDOW_HEIGHT));
-    sidePanel.setPosition(WINDOW_WIDTH - 200, 0);
-    sidePanel.setFillColor(sf::Color(30, 30, 30, 220));
-
     sf::Text turnText("", font, 24);
     turnText.setFillColor(sf::Color::White);
     turnText.setStyle(sf::Text::Bold);
@@ -243,8 +4402,15 @@ int main()
     legend.setPosition(WINDOW_WIDTH - 190, 110);
     legend.setString(
         "[E] Exportar\n"
+        "[G] Guardar  [L] Cargar\n"
+        "[Mayus+G] Guardar comprimido\n"
+        "[A] Archivar en mapas.cca\n"
+        "[I] Importar texto\n"
         "[R] Resolver\n"
         "[C] Limpiar\n"
+        "[Ctrl+Z/Y] Deshacer/Rehacer\n"
+        "[P] Perfil de fases\n"
+        "[T] Traza (trace.json)\n"
         "\n"
         "Leyenda:\n"
         "Cian - Cristal\n"
@@ -254,176 +4420,472 @@ int main()
         "Gris - Bloqueado\n"
         "Verde - Camino BFS");
 
-    while (window.isOpen())
+    // Progreso de la exportación en segundo plano
+    ExportacionTexto exportacion;
+    bool exportacionLanzada = false;
+    sf::Text exportText("", font, 14);
+    exportText.setFillColor(sf::Color(200, 200, 200));
+    exportText.setPosition(WINDOW_WIDTH - 190, WINDOW_HEIGHT - 40);
+
+    SolucionadorFondo solucionador;
+    sf::Text solucionText("", font, 14);
+    solucionText.setFillColor(sf::Color(200, 200, 200));
+    solucionText.setPosition(WINDOW_WIDTH - 190, WINDOW_HEIGHT - 80);
+
+    // Resultado del clic bajo el cursor, calculado en segundo plano
+    EvaluadorEspeculativo evaluador;
+    sf::Text prediccionText("", font, 14);
+    prediccionText.setFillColor(sf::Color(200, 200, 200));
+    prediccionText.setPosition(WINDOW_WIDTH - 190, WINDOW_HEIGHT - 60);
+
+    // Perfil de fases: ocupa el sitio de la leyenda mientras está encendido
+    sf::Text perfilText("", font, 12);
+    perfilText.setFillColor(sf::Color(230, 230, 230));
+    perfilText.setPosition(WINDOW_WIDTH - 190, 110);
+
+    CapaEstatica capa(WINDOW_WIDTH, WINDOW_HEIGHT);
+    PreparadorVertices preparador;
+
+    // Panel derecho; el hueco 2 es la leyenda o el perfil
+    PanelHud panel(WINDOW_WIDTH - 200, 200, WINDOW_HEIGHT);
+    panel.textos = {&turnText, &crystalText, &legend, &exportText, &prediccionText, &solucionText};
+    uint64_t turnoMostrado = ~0ULL, cristalesMostrados = ~0ULL, exportacionMostrada = ~0ULL,
+             solucionMostrada = ~0ULL;
+
+    // Latencia de entrada: SFML no marca los eventos con la hora, así que se
+    // toma al sacarlos de la cola. Cada acción que cambia la partida guarda esa
+    // marca hasta que window.display() devuelve el frame que la muestra.
+    using Instante = std::chrono::steady_clock::time_point;
+    Instante entradaActual{};
+    std::vector<Instante> entradasPendientes;
+    HistogramaTiempos latenciaEntrada;
+
+    // Tiempo de frame: de un window.display() al siguiente, toda la sesión
+    HistogramaTiempos tiempoFrame;
+    Instante ultimoFrame{};
+
+    // Toda acción que cambia la partida pasa por aquí para quedar en el diario
+    auto ejecutar = [&](const EventoDiario &ev, const std::vector<int> *cascada = nullptr)
     {
-        sf::Event event;
-        while (window.pollEvent(event))
+        if (entradaActual != Instante())
+            entradasPendientes.push_back(entradaActual);
+        diario.registrar(ev);
+        sf::Clock reloj;
+        if (ev.tipo == TipoEvento::Exportar)
         {
-            if (event.type == sf::Event::Closed)
-                window.close();
+            if (exportacion.iniciar(grid, rows, cols, rutaExportar))
+                exportacionLanzada = true;
+            else
+                std::cerr << "Ya hay una exportacion en curso" << std::endl;
+        }
+        else
+        {
+            aplicarEvento(partida, ev, cascada);
+        }
+        volcado.anotar(ev.tipo, partida.turnCounter, reloj.getElapsedTime().asSeconds() * 1000);
+    };
+    // Cargar e importar leen archivos que pueden cambiar: el diario guarda el
+    // tablero resultante
+    auto registrarTablero = [&]()
+    {
+        EventoDiario ev;
+        ev.tipo = TipoEvento::Tablero;
+        ev.tablero = comprimirTablero(grid, partida.cabecera());
+        diario.registrar(ev);
+        volcado.anotar(ev.tipo, partida.turnCounter, 0);
+        entradasPendientes.push_back(entradaActual);
+    };
 
-            if (event.type == sf::Event::KeyPressed)
+    // Comando a comando: la entrada solo encola y cada tick aplica la cola
+    auto simular = [&](const Comando &cmd)
+    {
+        entradaActual = cmd.entrada;
+        switch (cmd.tipo)
+        {
+        case Comando::Evento:
+        {
+            const Prediccion *prediccion = nullptr;
+            if (cmd.ev.tipo == TipoEvento::Pulsar)
+                prediccion = evaluador.valida(
+                    partida, indiceCelda(int(cmd.ev.celda / cols), int(cmd.ev.celda % cols), rows, cols));
+            ejecutar(cmd.ev, prediccion ? &prediccion->cascada : nullptr);
+            if (partida.solucionPendiente)
             {
-                if (event.key.code == sf::Keyboard::E)
+                solucionador.iniciar(partida);
+                partida.solucionPendiente = false;
+            }
+            break;
+        }
+        case Comando::Guardar:
+            guardarMapaBinario("mapa.bin", grid, partida.cabecera());
+            break;
+        case Comando::GuardarComprimido:
+            guardarMapaComprimido("mapa.ccz", grid, partida.cabecera());
+            break;
+        case Comando::Archivar:
+        {
+            EscritorArchivoMapas escritor;
+            if (escritor.abrir("mapas.cca"))
+            {
+                uint64_t id = escritor.anadir(comprimirTablero(grid, partida.cabecera()));
+                if (escritor.confirmar())
+                    std::cout << "Mapa archivado en mapas.cca con id " << id << std::endl;
+            }
+            break;
+        }
+        case Comando::Importar:
+        {
+            MapaTexto mapa;
+            if (importarEstadoMapa(rutaExportar, mapa))
+            {
+                if (mapa.rows != rows || mapa.cols != cols)
                 {
-                    exportarEstadoMapa(grid, rows, cols);
+                    std::cerr << "Error: " << rutaExportar << " tiene otras dimensiones" << std::endl;
                 }
-                else if (event.key.code == sf::Keyboard::R)
-{
-    // 1. Limpiar caminos anteriores
-    for (auto &cell : grid)
-        cell.isPath = false;
-
-    // 2. Verificar si ya hay cristal manual
-    bool hayCristalManual = false;
-    for (auto &c : grid)
-    {
-        if (c.isCrystal && !c.isReflected)
-        {
-            hayCristalManual = true;
+                else
+                {
+                    partida.iniciarAccion();
+                    partida.importar(mapa);
+                    partida.cerrarAccion();
+                    partida.actualizarCamino();
+                    registrarTablero();
+                }
+            }
             break;
         }
-    }
-
-    // 3. Si no hay, colocar uno que genere camino hasta la salida
-    if (!hayCristalManual)
-    {
-        bool colocado = false;
-        for (int intentos = 0; intentos < 300 && !colocado; ++intentos)
+        case Comando::Cargar:
         {
-            int idx = rand() % grid.size();
-            TriCell &c = grid[idx];
-            if (!c.isBlocked && !c.isExit)
+            MapaBinario mapa;
+            if (cargarMapaBinario("mapa.bin", mapa))
             {
-                // Limpiar todo antes de probar
-                for (auto &g : grid)
+                if ((int)mapa.cabecera->rows != rows || (int)mapa.cabecera->cols != cols)
                 {
-                    g.isCrystal = false;
-                    g.isReflected = false;
-                    g.isPath = false;
-                    if (!g.isExit && !g.isBlocked)
-                        g.triangle.setFillColor(sf::Color::White);
+                    std::cerr << "Error: mapa.bin tiene otras dimensiones" << std::endl;
                 }
-
-                // Colocar cristal y reflejar
-                c.isCrystal = true;
-                c.isReflected = false;
-                c.triangle.setFillColor(sf::Color::Cyan);
-                propagateReflection(grid, c.row, c.col, rows, cols);
-
-                // Verificar si hay camino
-                buscarCaminoBFS(grid, exitIndex, rows, cols);
-                bool caminoValido = false;
-                for (const auto &g : grid)
+                else
                 {
-                    if (g.isPath)
-                    {
-                        caminoValido = true;
-                        break;
-                    }
+                    partida.iniciarAccion();
+                    partida.cargar(mapa);
+                    partida.cerrarAccion();
+                    partida.actualizarCamino();
+                    registrarTablero();
                 }
-
-                if (caminoValido)
-                    colocado = true;
             }
+            break;
         }
-    }
-    else
+        }
+        entradaActual = Instante();
+    };
+    std::deque<Comando> comandos;
+    PasoFijo paso(hzSimulacion);
+
+    // En la repetición visual los eventos salen del diario al ritmo de los
+    // ticks, así que "--velocidad" no depende de los fps
+    EventoDiario pendiente;
+    bool hayPendiente = repitiendo && repeticion.siguiente(pendiente);
+
+    // Modo reposo: si en el frame anterior no quedó nada en marcha, el bucle
+    // se bloquea en waitEvent; y solo actualiza y redibuja si llegó un evento
+    // que puede cambiar lo que se ve o si cambió la partida. Mientras hay
+    // trabajo de fondo (o justo al acabar, para mostrar su resultado) se
+    // redibuja al ritmo del límite de fps.
+    bool esperar = false, ocupadoAntes = false;
+    uint64_t versionDibujada = ~0ULL;
+    int celdaHover = -1;
+    // "terminado" solo se lee con el hilo parado
+    auto hayTrabajo = [&]()
     {
-        buscarCaminoBFS(grid, exitIndex, rows, cols);
-    }
-}
+        return solucionador.lanzado || exportacion.enCurso || evaluador.enCurso || evaluador.terminado ||
+               preparador.enCurso || preparador.terminado || hayPendiente || !comandos.empty();
+    };
 
-                else if (event.key.code == sf::Keyboard::C)
+    while (window.isOpen())
+    {
+        sf::Event event;
+        bool hayEvento = false;
+        if (esperar)
+        {
+            hayEvento = window.waitEvent(event);
+            ultimoFrame = Instante(); // la espera no es tiempo de frame
+            paso.reanudar();
+        }
+
+        TramoTraza tramoFrame("frame");
+        TemporizadorFase temporizadorFrame(FASE_FRAME);
+        TemporizadorFase fase(FASE_EVENTOS);
+        bool eventoVisible = false;
+        while (hayEvento || window.pollEvent(event))
+        {
+            hayEvento = false;
+            entradaActual = std::chrono::steady_clock::now();
+            eventoVisible |= event.type != sf::Event::KeyReleased &&
+                             event.type != sf::Event::MouseButtonReleased &&
+                             event.type != sf::Event::TextEntered &&
+                             event.type != sf::Event::MouseWheelScrolled;
+            if (event.type == sf::Event::Closed)
+                window.close();
+
+            if (event.type == sf::Event::KeyPressed && !repitiendo)
+            {
+                Comando cmd;
+                cmd.entrada = entradaActual;
+                bool valido = true;
+                if (event.key.code == sf::Keyboard::E)
                 {
-                    for (auto &cell : grid)
-                    {
-                        if (!cell.isExit && !cell.isBlocked)
-                        {
-                            cell.isCrystal = false;
-                            cell.isReflected = false;
-                            cell.isPath = false;
-                            cell.triangle.setFillColor(sf::Color::White);
-                        }
-                    }
+                    cmd.ev.tipo = TipoEvento::Exportar;
                 }
+                else if (event.key.control &&
+                         (event.key.code == sf::Keyboard::Z || event.key.code == sf::Keyboard::Y))
+                {
+                    bool rehacer = event.key.code == sf::Keyboard::Y || event.key.shift;
+                    cmd.ev.tipo = rehacer ? TipoEvento::Rehacer : TipoEvento::Deshacer;
+                }
+                else if (event.key.code == sf::Keyboard::G)
+                    cmd.tipo = event.key.shift ? Comando::GuardarComprimido : Comando::Guardar;
+                else if (event.key.code == sf::Keyboard::A)
+                    cmd.tipo = Comando::Archivar;
+                else if (event.key.code == sf::Keyboard::I)
+                    cmd.tipo = Comando::Importar;
+                else if (event.key.code == sf::Keyboard::L)
+                    cmd.tipo = Comando::Cargar;
+                else if (event.key.code == sf::Keyboard::R)
+                    cmd.ev.tipo = TipoEvento::Resolver;
+                else if (event.key.code == sf::Keyboard::C)
+                    cmd.ev.tipo = TipoEvento::Limpiar;
+                else
+                    valido = false;
+                if (valido)
+                    comandos.push_back(cmd);
+            }
+            // El perfil no toca la partida: también vale durante la repetición
+            if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::P)
+                perfilFrames.encender(!perfilFrames.activo);
+            // [T] empieza a grabar la traza; con la traza en marcha, la vuelca
+            if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::T)
+            {
+                if (!trazaActiva)
+                    trazaActiva = true;
+                else if (registroTrazas.volcar("trace.json"))
+                    std::cout << "Traza volcada en trace.json" << std::endl;
             }
 
-            if (event.type == sf::Event::MouseButtonPressed)
+            if (event.type == sf::Event::MouseButtonPressed && !repitiendo)
             {
                 sf::Vector2f mousePos = window.mapPixelToCoords(sf::Mouse::getPosition(window));
-                for (auto &cell : grid)
+                int idx = celdaEnPunto(grid, mousePos, rows, cols);
+                if (idx != -1)
+                {
+                    Comando cmd;
+                    cmd.entrada = entradaActual;
+                    cmd.ev.tipo = TipoEvento::Pulsar;
+                    cmd.ev.celda = uint64_t(grid[idx].row) * cols + grid[idx].col;
+                    comandos.push_back(cmd);
+                }
+            }
+        }
+        entradaActual = Instante();
+
+        // Simulación a paso fijo: cada tick aplica los comandos en cola, los
+        // eventos de la repetición que ya tocan y el resultado del solucionador.
+        // Lo que se dibuja después es siempre el estado del último tick completo.
+        int ticks = paso.avanzar();
+        for (int t = 0; t < ticks; ++t)
+        {
+            fase.siguiente(FASE_SIMULACION);
+            paso.tick();
+            while (!comandos.empty())
+            {
+                simular(comandos.front());
+                comandos.pop_front();
+            }
+            while (hayPendiente && pendiente.ms <= paso.msSimulados * velocidad)
+            {
+                ejecutar(pendiente);
+                hayPendiente = repeticion.siguiente(pendiente);
+            }
+
+            // El solucionador se cancela si el tablero cambió desde su instantánea
+            fase.siguiente(FASE_SOLUCIONADOR);
+            if (solucionador.lanzado)
+            {
+                bool obsoleto = partida.registro.version != solucionador.version;
+                if (obsoleto)
+                    solucionador.cancelar = true;
+                if (!solucionador.enCurso())
                 {
-                    if (cell.triangle.getGlobalBounds().contains(mousePos))
+                    solucionador.lanzado = false;
+                    int celda = solucionador.mejorCelda();
+                    // Si terminó justo antes de cancelarlo, el resultado sigue siendo de otro tablero
+                    if (obsoleto)
+                        solucionador.estado = SOLUCION_CANCELADA;
+                    else if (celda != -1)
                     {
-                        if (!cell.isExit && !cell.isBlocked && !(cell.isCrystal && cell.isReflected))
-                        {
-                            cell.isCrystal = !cell.isCrystal;
-                            cell.isReflected = false;
-                            cell.triangle.setFillColor(cell.isCrystal ? sf::Color::Cyan : sf::Color::White);
-                            ++turnCounter;
-
-                            if (cell.isCrystal)
-                            {
-                                propagateReflection(grid, cell.row, cell.col, rows, cols);
-                            }
-
-                            if (turnCounter >= turnThreshold)
-                            {
-                                grid[exitIndex].isExit = false;
-                                grid[exitIndex].triangle.setFillColor(sf::Color::White);
-                                exitIndex = rand() % grid.size();
-                                grid[exitIndex].isExit = true;
-                                grid[exitIndex].triangle.setFillColor(sf::Color::Red);
-                                for (int i = 0; i < 5; ++i)
-                                {
-                                    int idx = rand() % grid.size();
-                                    if (!grid[idx].isExit && !grid[idx].isCrystal)
-                                    {
-                                        grid[idx].isBlocked = true;
-                                        grid[idx].triangle.setFillColor(sf::Color(50, 50, 50));
-                                    }
-                                }
-                                turnCounter = 0;
-                            }
-
-                            buscarCaminoBFS(grid, exitIndex, rows, cols);
-                        }
-                        break;
+                        EventoDiario ev;
+                        ev.tipo = TipoEvento::Solucion;
+                        ev.celda = uint64_t(grid[celda].row) * cols + grid[celda].col;
+                        ejecutar(ev);
                     }
                 }
             }
         }
+        // Como prueba de rendimiento, la repetición termina con el diario
+        if (repitiendo && !hayPendiente && presupuestoMs > 0)
+            window.close();
 
-        // Actualización del juego
-        int crystalCount = 0;
-        for (const auto &c : grid)
+        bool ocupado = hayTrabajo();
+        bool redibujar = !modoReposo || eventoVisible || ocupado || ocupadoAntes || perfilFrames.activo ||
+                         partida.registro.version != versionDibujada;
+        ocupadoAntes = ocupado;
+        if (!redibujar)
         {
-            if (c.isCrystal)
-                crystalCount++;
+            esperar = true;
+            continue;
         }
+        versionDibujada = partida.registro.version;
+
+        // Actualización del juego
+        fase.siguiente(FASE_HOVER);
+        int crystalCount = partida.indices.estados.cantidad(EstadoCelda::Cristal);
 
+        // Con la capa en textura los colores salen de las banderas y basta con
+        // mover la marca de hover; sin ella se dibujan todos los triángulos y
+        // hay que repintarlos todos igualmente
         sf::Vector2f mousePos = window.mapPixelToCoords(sf::Mouse::getPosition(window));
-        for (auto &cell : grid)
+        int nuevaHover = celdaEnPunto(grid, mousePos, rows, cols);
+        if (capa.enTextura)
+        {
+            if (celdaHover != -1)
+                grid[celdaHover].isHovered = false;
+            if (nuevaHover != -1)
+                grid[nuevaHover].isHovered = true;
+        }
+        else
+        {
+            for (int i = 0; i < (int)grid.size(); ++i)
+                grid[i].updateHover(i == nuevaHover);
+        }
+        celdaHover = nuevaHover;
+
+        // Vista previa tenue de lo que haría el clic
+        fase.siguiente(FASE_PREVISTA);
+        evaluador.actualizar(partida, repitiendo ? -1 : celdaHover);
+        const Prediccion *prediccion = evaluador.valida(partida, celdaHover);
+        if (prediccion && !capa.enTextura)
+        {
+            for (int idx : prediccion->cascada)
+                grid[idx].triangle.setFillColor(sf::Color(205, 240, 240));
+            for (int idx : prediccion->camino)
+            {
+                if (!grid[idx].isExit && idx != celdaHover)
+                    grid[idx].triangle.setFillColor(sf::Color(190, 240, 190));
+            }
+        }
+
+        fase.siguiente(FASE_TEXTOS);
+        if (PanelHud::cambia(turnoMostrado, partida.turnCounter))
+            panel.poner(turnText, "Turno: " + std::to_string(partida.turnCounter));
+        if (PanelHud::cambia(cristalesMostrados, crystalCount))
+            panel.poner(crystalText, "Cristales: " + std::to_string(crystalCount));
+        if (exportacion.enCurso)
         {
-            cell.updateHover(mousePos);
+            if (PanelHud::cambia(exportacionMostrada, exportacion.porcentaje()))
+                panel.poner(exportText, "Exportando... " + std::to_string(exportacion.porcentaje()) + "%");
         }
+        else if (exportacionLanzada)
+        {
+            exportacionMostrada = ~0ULL;
+            panel.poner(exportText, exportacion.ok ? "Exportado: " + rutaExportar : "Error al exportar");
+        }
+        if (solucionador.lanzado)
+        {
+            if (PanelHud::cambia(solucionMostrada, uint64_t(solucionador.intentos) << 32 |
+                                                        uint32_t(solucionador.mejorDistancia())))
+                panel.poner(solucionText,
+                            "Resolviendo... " + std::to_string(solucionador.intentos) + "/" +
+                                std::to_string(SolucionadorFondo::MAX_INTENTOS) +
+                                (solucionador.mejorCelda() == -1
+                                     ? std::string()
+                                     : "  mejor a " + std::to_string(solucionador.mejorDistancia())));
+        }
+        else
+        {
+            solucionMostrada = ~0ULL;
+            panel.poner(solucionText, solucionador.estado == SOLUCION_AGOTADA ? "Sin solucion: el mejor intento" : "");
+        }
+        if (!prediccion)
+            panel.poner(prediccionText, "");
+        else if (prediccion->disparaTurno)
+            panel.poner(prediccionText, "Este clic movera la salida");
+        else
+            panel.poner(prediccionText, "Reflejos: " + std::to_string(prediccion->cascada.size()) +
+                                            (prediccion->camino.empty() ? "  sin camino" : "  con camino"));
 
-        turnText.setString("Turno: " + std::to_string(turnCounter));
-        crystalText.setString("Cristales: " + std::to_string(crystalCount));
+        // El resumen se rehace cada pocos frames: ordenar la ventana cuesta
+        if (perfilFrames.activo && perfilFrames.frames % 16 == 0)
+            panel.poner(perfilText, perfilFrames.resumen() + "\nEntrada->pantalla\n" + latenciaEntrada.resumen());
+        panel.cambiar(2, perfilFrames.activo ? &perfilText : &legend);
 
         // Renderizado
+        fase.siguiente(FASE_DIBUJO);
+        if (capa.actualizar(grid, rows, cols))
+            preparador.configurar(grid, capa.filasVisibles, capa.colsVisibles, rows, cols);
+        if (capa.enTextura)
+        {
+            if (prediccion)
+                capa.marcarPrevista(grid, *prediccion);
+            preparador.sincronizar(capa.estados);
+        }
         window.clear(sf::Color::Black);
-        for (const auto &cell : grid)
-            window.draw(cell.triangle);
+        capa.dibujar(window, grid);
+        if (capa.enTextura)
+            preparador.dibujar(window);
 
         // Panel y textos
-        window.draw(sidePanel);
-        window.draw(turnText);
-        window.draw(crystalText);
-        window.draw(legend);
+        panel.dibujar(window);
+        fase.siguiente(FASE_PRESENTAR);
         window.display();
+        Instante mostrado = std::chrono::steady_clock::now();
+        if (ultimoFrame != Instante())
+            tiempoFrame.anotarMs(std::chrono::duration<double, std::milli>(mostrado - ultimoFrame).count());
+        ultimoFrame = mostrado;
+        if (!entradasPendientes.empty())
+        {
+            for (const Instante &t : entradasPendientes)
+                latenciaEntrada.anotarMs(std::chrono::duration<double, std::milli>(mostrado - t).count());
+            entradasPendientes.clear();
+        }
+        esperar = modoReposo && !hayTrabajo() && !ocupadoAntes && !perfilFrames.activo;
+        fase.cerrar();
+        temporizadorFrame.cerrar();
+        perfilFrames.cerrarFrame();
     }
+    // Lo que quedó en cola al cerrar también llega al diario
+    for (const Comando &cmd : comandos)
+        simular(cmd);
 
+    if (trazaActiva && registroTrazas.volcar("trace.json"))
+        std::cout << "Traza volcada en trace.json" << std::endl;
+    if (latenciaEntrada.total > 0)
+        std::cout << "Latencia entrada->pantalla: " << latenciaEntrada.resumen() << std::endl;
+    std::ofstream resumen(rutaResumenFrames);
+    if (resumen)
+    {
+        resumen << "# tiempo de frame\n";
+        tiempoFrame.escribir(resumen);
+        resumen << "# latencia entrada->pantalla\n";
+        latenciaEntrada.escribir(resumen);
+    }
+    std::cout << "Tiempo de frame: " << tiempoFrame.resumen() << std::endl;
+    std::cout << "Simulacion: " << paso.ticks << " ticks";
+    if (paso.perdidos > 0)
+        std::cout << " (" << paso.perdidos << " perdidos por frames lentos)";
+    std::cout << std::endl;
+    std::cout << "Huella final: " << partida.huella() << std::endl;
+    if (presupuestoMs > 0 && tiempoFrame.percentil(99) > presupuestoMs)
+    {
+        std::cerr << "Presupuesto superado: p99 " << tiempoFrame.percentil(99) << " ms > " << presupuestoMs
+                  << " ms" << std::endl;
+        return 2;
+    }
     return 0;
 }
\ No newline at end of file